@@ -7,13 +7,14 @@
 #include "audio.h"
 #include "config.h"
 #include "main.h"
+#include "sync.h"
 #include "thread_safe.h"
 #include "utility.h"
 
 namespace audio {
 using namespace std::literals;
 using opus_t         = util::safe_ptr<OpusMSEncoder, opus_multistream_encoder_destroy>;
-using sample_queue_t = std::shared_ptr<safe::queue_t<std::vector<std::int16_t>>>;
+using sample_queue_t = std::shared_ptr<safe::spsc_ring_t<std::vector<std::int16_t>>>;
 
 struct audio_ctx_t {
   // We want to change the sink for the first stream only
@@ -72,8 +73,51 @@ opus_stream_config_t stream_configs[MAX_STREAM_CONFIG] {
 
 auto control_shared = safe::make_shared<audio_ctx_t>(start_audio_control, stop_audio_control);
 
-void encodeThread(sample_queue_t samples, config_t config, void *channel_data) {
-  auto packets = mail::man->queue<packet_t>(mail::audio_packets);
+// Large enough for any opus packet we send
+constexpr auto MAX_PACKET_SIZE = 1400;
+
+// More than the packets that can be queued at any time
+constexpr auto MAX_FREE_PACKETS = 64;
+
+// Packets handed back by the broadcast thread once sent
+static util::sync_t<std::vector<buffer_t>> free_packets;
+
+// The packets that had to be allocated, zero in steady state
+static std::atomic<std::uint64_t> packet_allocations;
+
+buffer_t alloc_packet() {
+  {
+    auto lg = free_packets.lock();
+
+    if(!free_packets->empty()) {
+      auto packet = std::move(free_packets->back());
+      free_packets->pop_back();
+
+      // The previous owner may have shrunk it
+      packet.fake_resize(MAX_PACKET_SIZE);
+
+      return packet;
+    }
+  }
+
+  ++packet_allocations;
+  return buffer_t::uninitialized(MAX_PACKET_SIZE);
+}
+
+void free_packet(buffer_t &&packet) {
+  auto lg = free_packets.lock();
+
+  if(free_packets->size() < MAX_FREE_PACKETS) {
+    free_packets->reserve(MAX_FREE_PACKETS);
+    free_packets->emplace_back(std::move(packet));
+  }
+}
+
+/**
+ * free_samples --> the sample buffers are handed back through it once encoded
+ */
+void encodeThread(sample_queue_t samples, sample_queue_t free_samples, config_t config, void *channel_data) {
+  auto packets = mail::man->ring<packet_t>(mail::audio_packets);
 
   //FIXME: Pick correct opus_stream_config_t based on config.channels
   auto stream = &stream_configs[map_stream(config.channels, config.flags[config_t::HIGH_QUALITY])];
@@ -92,11 +136,24 @@ void encodeThread(sample_queue_t samples, config_t config, void *channel_data) {
   // which tries to occupy as much space as possible in the packet
   opus_multistream_encoder_ctl(opus.get(), OPUS_SET_BITRATE(OPUS_BITRATE_MAX));
 
+  // Packets the packet queue had no room for
+  std::uint64_t dropped_packets = 0;
+
+  auto fg = util::fail_guard([&dropped_packets]() {
+    BOOST_LOG(debug) << "Audio: allocated ["sv << packet_allocations.exchange(0) << "] packets"sv;
+
+    if(dropped_packets) {
+      BOOST_LOG(info) << "Audio: dropped ["sv << dropped_packets << "] packets the stream couldn't keep up with"sv;
+    }
+  });
+
   auto frame_size = config.packetDuration * stream->sampleRate / 1000;
   while(auto sample = samples->pop()) {
-    buffer_t packet { 1400 }; // 1KB
+    auto packet = alloc_packet();
 
     int bytes = opus_multistream_encode(opus.get(), sample->data(), frame_size, std::begin(packet), packet.size());
+
+    free_samples->raise(std::move(*sample));
     if(bytes < 0) {
       BOOST_LOG(error) << "Couldn't encode audio: "sv << opus_strerror(bytes);
       packets->stop();
@@ -109,11 +166,19 @@ void encodeThread(sample_queue_t samples, config_t config, void *channel_data) {
     // A packet size of 128 seems a reasonable enough threshold
     if(bytes < 128) {
       BOOST_LOG(verbose) << "Dropped silent packet"sv;
+
+      free_packet(std::move(packet));
       continue;
     }
 
     packet.fake_resize(bytes);
-    packets->raise(channel_data, std::move(packet));
+
+    // The queue is shared by the encoders of every session, so only the packet being queued can be dropped
+    if(!packets->raise(channel_data, std::move(packet))) {
+      ++dropped_packets;
+
+      free_packet(std::move(packet));
+    }
   }
 }
 
@@ -163,12 +228,28 @@ void capture(safe::mail_t mail, config_t config, void *channel_data) {
   }
 
   auto samples = std::make_shared<sample_queue_t::element_type>(30);
-  std::thread thread { encodeThread, samples, config, channel_data };
+
+  // The encoder hands the sample buffers back, so capturing doesn't allocate in steady state
+  auto free_samples = std::make_shared<sample_queue_t::element_type>(32);
+
+  std::thread thread { encodeThread, samples, free_samples, config, channel_data };
+
+  // Frames of samples the encoder couldn't keep up with
+  std::uint64_t dropped_samples = 0;
+
+  // The sample buffers that had to be allocated, zero in steady state
+  std::uint64_t sample_allocations = 0;
 
   auto fg = util::fail_guard([&]() {
     samples->stop();
     thread.join();
 
+    BOOST_LOG(debug) << "Audio: allocated ["sv << sample_allocations << "] sample buffers"sv;
+
+    if(dropped_samples) {
+      BOOST_LOG(info) << "Audio: dropped ["sv << dropped_samples << "] frames of samples the encoder couldn't keep up with"sv;
+    }
+
     shutdown_event->view();
   });
 
@@ -182,9 +263,18 @@ void capture(safe::mail_t mail, config_t config, void *channel_data) {
     return;
   }
 
+  // Empty once handed to the encoder
+  std::vector<std::int16_t> sample_buffer;
   while(!shutdown_event->peek()) {
-    std::vector<std::int16_t> sample_buffer;
-    sample_buffer.resize(samples_per_frame);
+    if(sample_buffer.empty()) {
+      if(free_samples->peek()) {
+        sample_buffer = std::move(*free_samples->pop());
+      }
+      else {
+        ++sample_allocations;
+        sample_buffer.resize(samples_per_frame);
+      }
+    }
 
     auto status = mic->sample(sample_buffer);
     switch(status) {
@@ -205,7 +295,16 @@ void capture(safe::mail_t mail, config_t config, void *channel_data) {
       return;
     }
 
-    samples->raise(std::move(sample_buffer));
+    // Old samples only add latency. Either way, a dropped buffer is reused for the next frame
+    if(config::stream.drop_oldest) {
+      if(auto dropped = samples->raise_drop_oldest(std::move(sample_buffer), false)) {
+        ++dropped_samples;
+        sample_buffer = std::move(*dropped);
+      }
+    }
+    else if(!samples->raise(std::move(sample_buffer))) {
+      ++dropped_samples;
+    }
   }
 }
 
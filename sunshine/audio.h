@@ -39,6 +39,14 @@ struct config_t {
 
 using buffer_t = util::buffer_t<std::uint8_t>;
 using packet_t = std::pair<void *, buffer_t>;
+
+/**
+ * Packets are recycled through a free list, so encoding audio doesn't allocate in steady state.
+ * Call free_packet() once a packet is sent
+ */
+buffer_t alloc_packet();
+void free_packet(buffer_t &&packet);
+
 void capture(safe::mail_t mail, config_t config, void *channel_data);
 } // namespace audio
 
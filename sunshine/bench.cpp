@@ -0,0 +1,511 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+extern "C" {
+#include <rs.h>
+}
+
+#include "bench.h"
+#include "blend.h"
+#include "gf256.h"
+#include "thread_safe.h"
+#include "utility.h"
+#include "yuv.h"
+
+using namespace std::literals;
+namespace bench {
+using bench_f = int (*)();
+
+/**
+ * Call f repeatedly for at least min_duration
+ * returns the average duration of a single call in seconds
+ */
+template<class F>
+double measure(F &&f, std::chrono::milliseconds min_duration = 200ms) {
+  // warm up the caches
+  f();
+
+  std::size_t iterations = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  auto now   = start;
+  while(now - start < min_duration) {
+    for(auto x = 0; x < 16; ++x) {
+      f();
+    }
+
+    iterations += 16;
+    now = std::chrono::steady_clock::now();
+  }
+
+  return std::chrono::duration<double>(now - start).count() / iterations;
+}
+
+/**
+ * Compare the parity generated by rs.c with the parity generated by gf256
+ */
+int fec() {
+  reed_solomon_init();
+  gf256::init();
+
+  constexpr auto data_shards   = 100;
+  constexpr auto parity_shards = 20;
+
+  std::cout << "FEC: "sv << data_shards << " data shards, "sv << parity_shards << " parity shards, gf256 --> "sv << gf256::name() << std::endl;
+  std::cout << std::setw(10) << "shard"sv << std::setw(14) << "rs.c MB/s"sv << std::setw(14) << "gf256 MB/s"sv << std::setw(10) << "speedup"sv << std::endl;
+
+  util::safe_ptr<reed_solomon, reed_solomon_release> rs { reed_solomon_new(data_shards, parity_shards) };
+  if(!rs) {
+    std::cout << "Couldn't create reed solomon encoder"sv << std::endl;
+    return -1;
+  }
+
+  std::default_random_engine engine;
+  std::uniform_int_distribution<int> dist { 0, 255 };
+
+  for(auto blocksize : { 64, 256, 1040, 1500, 4096, 16384 }) {
+    std::vector<std::uint8_t> shards(data_shards * blocksize + parity_shards * blocksize * 2);
+    std::vector<std::uint8_t *> shards_expected;
+    std::vector<std::uint8_t *> shards_actual;
+
+    for(auto &byte : shards) {
+      byte = dist(engine);
+    }
+
+    for(auto x = 0; x < data_shards; ++x) {
+      shards_expected.emplace_back(&shards[x * blocksize]);
+      shards_actual.emplace_back(&shards[x * blocksize]);
+    }
+
+    for(auto x = 0; x < parity_shards; ++x) {
+      shards_expected.emplace_back(&shards[(data_shards + x) * blocksize]);
+      shards_actual.emplace_back(&shards[(data_shards + parity_shards + x) * blocksize]);
+    }
+
+    auto rs_time = measure([&]() {
+      reed_solomon_encode(rs.get(), shards_expected.data(), data_shards + parity_shards, blocksize);
+    });
+
+    auto gf256_time = measure([&]() {
+      gf256::encode(rs.get(), shards_actual.data(), data_shards + parity_shards, blocksize);
+    });
+
+    auto parity_begin = std::begin(shards) + data_shards * blocksize;
+    auto parity_size  = parity_shards * blocksize;
+    if(!std::equal(parity_begin, parity_begin + parity_size, parity_begin + parity_size)) {
+      std::cout << "gf256 generated different parity shards for blocksize ["sv << blocksize << ']' << std::endl;
+      return -1;
+    }
+
+    auto megabytes = data_shards * blocksize / 1000000.0;
+    std::cout
+      << std::setw(10) << blocksize
+      << std::setw(14) << std::fixed << std::setprecision(1) << megabytes / rs_time
+      << std::setw(14) << megabytes / gf256_time
+      << std::setw(9) << std::setprecision(2) << rs_time / gf256_time << 'x' << std::endl;
+  }
+
+  return 0;
+}
+
+/**
+ * returns the number of context switches of the calling thread, or 0 if unknown
+ */
+static long context_switches() {
+#ifdef __linux__
+  rusage usage;
+  if(!getrusage(RUSAGE_THREAD, &usage)) {
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+  }
+#endif
+
+  return 0;
+}
+
+/**
+ * Two producers each raise a timestamp every interval, like the encoders of two sessions.
+ * Prints the latency between raise() and pop(), and the context switches of the consumer
+ */
+template<class Q>
+static void queue_latency(const std::string_view &name, std::chrono::microseconds interval) {
+  constexpr auto producers = 2;
+  constexpr auto elements  = 2000;
+
+  Q queue { 32 };
+
+  std::vector<std::thread> threads;
+  for(auto x = 0; x < producers; ++x) {
+    threads.emplace_back([&queue, interval]() {
+      for(auto x = 0; x < elements; ++x) {
+        queue.raise(std::chrono::steady_clock::now().time_since_epoch().count());
+
+        std::this_thread::sleep_for(interval);
+      }
+    });
+  }
+
+  std::vector<double> latencies;
+  latencies.reserve(producers * elements);
+
+  auto switches = context_switches();
+  while(latencies.size() < producers * elements) {
+    auto timestamp = queue.pop(100ms);
+    if(!timestamp) {
+      break;
+    }
+
+    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    latencies.emplace_back(std::chrono::duration<double, std::micro> { std::chrono::steady_clock::duration { now - *timestamp } }.count());
+  }
+  switches = context_switches() - switches;
+
+  for(auto &thread : threads) {
+    thread.join();
+  }
+
+  std::sort(std::begin(latencies), std::end(latencies));
+
+  auto average = std::accumulate(std::begin(latencies), std::end(latencies), 0.0) / latencies.size();
+  auto p99     = latencies[latencies.size() * 99 / 100];
+
+  std::cout
+    << std::setw(10) << name
+    << std::setw(12) << interval.count()
+    << std::setw(14) << std::fixed << std::setprecision(1) << average
+    << std::setw(14) << p99
+    << std::setw(16) << std::setprecision(2) << (double)switches / latencies.size() << std::endl;
+}
+
+/**
+ * Compare safe::queue_t with safe::ring_t, as used by the media queues
+ */
+int queue() {
+  std::cout << "Queue: 2 producers, 1 consumer"sv << std::endl;
+  std::cout
+    << std::setw(10) << "queue"sv
+    << std::setw(12) << "interval us"sv
+    << std::setw(14) << "average us"sv
+    << std::setw(14) << "p99 us"sv
+    << std::setw(16) << "switches/pop"sv << std::endl;
+
+  for(auto interval : { 20us, 200us, 1000us }) {
+    queue_latency<safe::queue_t<std::int64_t>>("queue_t"sv, interval);
+    queue_latency<safe::ring_t<std::int64_t>>("ring_t"sv, interval);
+  }
+
+  return 0;
+}
+
+/**
+ * The cursor blending as it was done before blend::over, dividing by 255 for each channel
+ */
+static void blend_division(const std::uint32_t *src, std::uint32_t *dst, int count) {
+  for(auto x = 0; x < count; ++x) {
+    auto pixel = src[x];
+    auto alpha = pixel >> 24u;
+    if(alpha == 255) {
+      dst[x] = pixel;
+      continue;
+    }
+
+    auto colors_in  = (std::uint8_t *)&dst[x];
+    auto colors_out = (std::uint8_t *)&pixel;
+    for(auto c = 0; c < 3; ++c) {
+      colors_in[c] = colors_out[c] + (colors_in[c] * (255 - alpha) + 255 / 2) / 255;
+    }
+  }
+}
+
+/**
+ * Compare blend::over with blend_division for cursors of increasing size, blended into a 1080p frame.
+ * The arrow is mostly transparent like a real cursor, the other cursor is translucent noise
+ */
+int cursor() {
+  blend::init();
+
+  constexpr auto frame_width = 1920;
+
+  std::cout << "Cursor: blend --> "sv << blend::name() << std::endl;
+  std::cout
+    << std::setw(10) << "cursor"sv
+    << std::setw(8) << "size"sv
+    << std::setw(16) << "division Mpx/s"sv
+    << std::setw(14) << "blend Mpx/s"sv
+    << std::setw(10) << "speedup"sv << std::endl;
+
+  std::default_random_engine engine;
+  std::uniform_int_distribution<int> dist { 0, 255 };
+
+  auto premultiplied = [&](int alpha) -> std::uint32_t {
+    std::uint32_t pixel = alpha << 24;
+    for(auto c = 0; c < 3; ++c) {
+      pixel |= (dist(engine) * alpha / 255) << (c * 8);
+    }
+
+    return pixel;
+  };
+
+  for(auto arrow : { true, false }) {
+    for(auto size : { 32, 64, 256 }) {
+      std::vector<std::uint32_t> overlay(size * size);
+      for(auto y = 0; y < size; ++y) {
+        for(auto x = 0; x < size; ++x) {
+          auto &pixel = overlay[y * size + x];
+
+          if(!arrow) {
+            pixel = premultiplied(dist(engine));
+          }
+          else if(x < y / 2) {
+            pixel = premultiplied(255);
+          }
+          else if(x < y / 2 + 2) {
+            pixel = premultiplied(dist(engine));
+          }
+          else {
+            pixel = 0;
+          }
+        }
+      }
+
+      std::vector<std::uint32_t> frame(frame_width * size);
+      for(auto &pixel : frame) {
+        pixel = premultiplied(255);
+      }
+
+      auto expected = frame;
+      auto actual   = frame;
+
+      auto blend_rows = [&](auto &&over, std::vector<std::uint32_t> &frame) {
+        for(auto y = 0; y < size; ++y) {
+          over(&overlay[y * size], &frame[y * frame_width], size);
+        }
+      };
+
+      blend_rows(blend_division, expected);
+      blend_rows(blend::over, actual);
+
+      for(auto x = 0; x < frame.size(); ++x) {
+        auto colors_expected = (std::uint8_t *)&expected[x];
+        auto colors_actual   = (std::uint8_t *)&actual[x];
+
+        for(auto c = 0; c < 4; ++c) {
+          if(colors_expected[c] != colors_actual[c]) {
+            std::cout << "blend::over differs from the division at pixel ["sv << x << "] channel ["sv << c << ']' << std::endl;
+            return -1;
+          }
+        }
+      }
+
+      auto division_time = measure([&]() {
+        blend_rows(blend_division, expected);
+      });
+
+      auto blend_time = measure([&]() {
+        blend_rows(blend::over, actual);
+      });
+
+      auto megapixels = size * size / 1000000.0;
+      std::cout
+        << std::setw(10) << (arrow ? "arrow"sv : "noise"sv)
+        << std::setw(8) << size
+        << std::setw(16) << std::fixed << std::setprecision(1) << megapixels / division_time
+        << std::setw(14) << megapixels / blend_time
+        << std::setw(9) << std::setprecision(2) << division_time / blend_time << 'x' << std::endl;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * The conversion as defined by the standard, in floating point.
+ * v == nullptr --> NV12
+ */
+static void yuv_reference(float Kr, float Kb, bool full_range, const std::uint8_t *bgrx, int width, int height, std::uint8_t *y, std::uint8_t *u, std::uint8_t *v) {
+  auto Kg = 1.0f - Kr - Kb;
+
+  auto y_scale  = full_range ? 1.0f : 219.0f / 255.0f;
+  auto uv_scale = full_range ? 1.0f : 224.0f / 255.0f;
+  auto y_offset = full_range ? 0.0f : 16.0f;
+
+  auto to_u8 = [](float x) {
+    return (std::uint8_t)std::clamp(std::lround(x), 0l, 255l);
+  };
+
+  for(auto row = 0; row < height; row += 2) {
+    for(auto x = 0; x < width; x += 2) {
+      float b = 0, g = 0, r = 0;
+      for(auto pixel : { row * width + x, row * width + x + 1, (row + 1) * width + x, (row + 1) * width + x + 1 }) {
+        auto colors = bgrx + pixel * 4;
+
+        y[pixel] = to_u8(y_offset + y_scale * (Kr * colors[2] + Kg * colors[1] + Kb * colors[0]));
+
+        b += colors[0] / 4.0f;
+        g += colors[1] / 4.0f;
+        r += colors[2] / 4.0f;
+      }
+
+      auto luma = Kr * r + Kg * g + Kb * b;
+      auto cb   = to_u8(128.0f + uv_scale * (b - luma) / (2.0f * (1.0f - Kb)));
+      auto cr   = to_u8(128.0f + uv_scale * (r - luma) / (2.0f * (1.0f - Kr)));
+
+      auto chroma = row / 2 * width / 2 + x / 2;
+      if(v) {
+        u[chroma] = cb;
+        v[chroma] = cr;
+      }
+      else {
+        u[chroma * 2]     = cb;
+        u[chroma * 2 + 1] = cr;
+      }
+    }
+  }
+}
+
+/**
+ * Compare yuv::convert with the floating point conversion for each matrix, then measure the conversion
+ * of a single thread and of yuv::converter_t for the resolutions streamed the most
+ */
+int yuv() {
+  yuv::init();
+
+  auto nr_threads = std::clamp((int)std::thread::hardware_concurrency(), 1, 8);
+
+  std::cout << "YUV: "sv << yuv::name() << ", "sv << nr_threads << " threads"sv << std::endl;
+  std::cout
+    << std::setw(10) << "size"sv
+    << std::setw(9) << "format"sv
+    << std::setw(18) << "reference Mpx/s"sv
+    << std::setw(16) << "1 thread Mpx/s"sv
+    << std::setw(16) << "threads Mpx/s"sv
+    << std::setw(10) << "speedup"sv << std::endl;
+
+  yuv::converter_t converter;
+  converter.start(nr_threads - 1);
+
+  std::default_random_engine engine;
+  std::uniform_int_distribution<int> dist { 0, 255 };
+
+  for(auto [width, height] : { std::pair { 1920, 1080 }, std::pair { 3840, 2160 } }) {
+    std::vector<std::uint8_t> bgrx(width * height * 4);
+
+    // Noise over a gradient, so both the extremes and the rounding get tested
+    for(auto x = 0; x < bgrx.size(); ++x) {
+      bgrx[x] = x % 4 == 3 ? 0 : std::clamp((int)(x / 4 % width * 256 / width) + dist(engine) / 4 - 32, 0, 255);
+    }
+
+    for(auto nv12 : { false, true }) {
+      std::vector<std::uint8_t> expected(width * height * 3 / 2);
+      std::vector<std::uint8_t> actual(expected.size());
+
+      auto planes = [&](std::vector<std::uint8_t> &buffer) {
+        auto y = buffer.data();
+        auto u = y + width * height;
+
+        return yuv::planes_t {
+          y,
+          u,
+          nv12 ? nullptr : u + width * height / 4,
+          width,
+          nv12 ? width : width / 2
+        };
+      };
+
+      for(auto [Kr, Kb] : { std::pair { 0.299f, 0.114f }, std::pair { 0.2126f, 0.0722f } }) {
+        for(auto full_range : { false, true }) {
+          auto matrix = yuv::make_matrix(Kr, Kb, full_range);
+
+          auto expected_planes = planes(expected);
+          yuv_reference(Kr, Kb, full_range, bgrx.data(), width, height, expected_planes.y, expected_planes.u, expected_planes.v);
+          converter.convert(matrix, bgrx.data(), width * 4, width, height, planes(actual));
+
+          for(auto x = 0; x < expected.size(); ++x) {
+            if(std::abs(expected[x] - actual[x]) > 1) {
+              std::cout << "yuv::convert differs by more than 1 from the reference at byte ["sv << x << "] of "sv << width << 'x' << height << std::endl;
+              return -1;
+            }
+          }
+        }
+      }
+
+      auto matrix = yuv::make_matrix(0.2126f, 0.0722f, false);
+
+      auto expected_planes = planes(expected);
+      auto reference_time  = measure([&]() {
+        yuv_reference(0.2126f, 0.0722f, false, bgrx.data(), width, height, expected_planes.y, expected_planes.u, expected_planes.v);
+      });
+
+      auto thread_time = measure([&]() {
+        yuv::convert(matrix, bgrx.data(), width * 4, width, 0, height, planes(actual));
+      });
+
+      auto threads_time = measure([&]() {
+        converter.convert(matrix, bgrx.data(), width * 4, width, height, planes(actual));
+      });
+
+      auto megapixels = width * height / 1000000.0;
+      std::cout
+        << std::setw(10) << (std::to_string(width) + 'x' + std::to_string(height))
+        << std::setw(9) << (nv12 ? "nv12"sv : "yuv420p"sv)
+        << std::setw(18) << std::fixed << std::setprecision(1) << megapixels / reference_time
+        << std::setw(16) << megapixels / thread_time
+        << std::setw(16) << megapixels / threads_time
+        << std::setw(9) << std::setprecision(2) << reference_time / threads_time << 'x' << std::endl;
+    }
+  }
+
+  return 0;
+}
+
+static std::map<std::string_view, bench_f> benchmarks {
+  { "cursor"sv, cursor },
+  { "fec"sv, fec },
+  { "queue"sv, queue },
+  { "yuv"sv, yuv }
+};
+
+int entry(const char *name, int argc, char *argv[]) {
+  if(argc == 0) {
+    for(auto &[_, bench] : benchmarks) {
+      if(bench()) {
+        return 1;
+      }
+    }
+
+    return 0;
+  }
+
+  for(auto x = 0; x < argc; ++x) {
+    auto bench = benchmarks.find(argv[x]);
+    if(bench == std::end(benchmarks)) {
+      std::cout << "Unknown benchmark: "sv << argv[x] << std::endl
+                << "Possible benchmarks:"sv << std::endl;
+      for(auto &[key, _] : benchmarks) {
+        std::cout << '\t' << key << std::endl;
+      }
+
+      return 7;
+    }
+
+    if(bench->second()) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+} // namespace bench
@@ -0,0 +1,13 @@
+#ifndef SUNSHINE_BENCH_H
+#define SUNSHINE_BENCH_H
+
+/**
+ * Microbenchmarks for the hot paths of the streaming pipeline
+ *
+ * sunshine --bench [name...]
+ */
+namespace bench {
+int entry(const char *name, int argc, char *argv[]);
+} // namespace bench
+
+#endif //SUNSHINE_BENCH_H
@@ -0,0 +1,217 @@
+#include <iterator>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SUNSHINE_BLEND_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SUNSHINE_BLEND_NEON
+#endif
+
+#include "blend.h"
+#include "main.h"
+
+using namespace std::literals;
+namespace blend {
+// Blends the pixels [begin, end)
+// returns the offset of the first pixel it didn't blend
+using over_f = int (*)(const std::uint32_t *src, std::uint32_t *dst, int begin, int end);
+
+static int over_scalar(const std::uint32_t *src, std::uint32_t *dst, int begin, int end) {
+  for(auto x = begin; x < end; ++x) {
+    auto pixel = src[x];
+    if(!pixel) {
+      continue;
+    }
+
+    auto alpha = pixel >> 24u;
+    if(alpha == 255) {
+      dst[x] = pixel;
+      continue;
+    }
+
+    auto colors_in  = (std::uint8_t *)&dst[x];
+    auto colors_out = (std::uint8_t *)&pixel;
+    for(auto c = 0; c < 3; ++c) {
+      std::uint32_t t = colors_in[c] * (255 - alpha) + 255 / 2;
+
+      colors_in[c] = colors_out[c] + ((t + (t >> 8) + 1) >> 8);
+    }
+  }
+
+  return end;
+}
+
+#ifdef SUNSHINE_BLEND_X86
+/**
+ * d, s --> 2 pixels of dst and src, widened to 16 bits per channel
+ * returns d * (255 - s.a) / 255
+ */
+__attribute__((target("sse2"))) static inline __m128i scale_sse2(__m128i d, __m128i s) {
+  auto alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+  auto t = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), alpha)), _mm_set1_epi16(255 / 2));
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), _mm_set1_epi16(1)), 8);
+}
+
+__attribute__((target("sse2"))) static int over_sse2(const std::uint32_t *src, std::uint32_t *dst, int begin, int end) {
+  auto zero   = _mm_setzero_si128();
+  auto opaque = _mm_set1_epi32(0xFF000000);
+
+  for(; begin + 4 <= end; begin += 4) {
+    auto s = _mm_loadu_si128((const __m128i *)(src + begin));
+
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xFFFF) {
+      continue;
+    }
+
+    auto is_opaque = _mm_cmpeq_epi32(_mm_and_si128(s, opaque), opaque);
+    if(_mm_movemask_epi8(is_opaque) == 0xFFFF) {
+      _mm_storeu_si128((__m128i *)(dst + begin), s);
+      continue;
+    }
+
+    auto d = _mm_loadu_si128((const __m128i *)(dst + begin));
+
+    auto lo = scale_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero));
+    auto hi = scale_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero));
+
+    auto out  = _mm_add_epi8(_mm_packus_epi16(lo, hi), s);
+    auto keep = _mm_andnot_si128(is_opaque, opaque);
+
+    _mm_storeu_si128((__m128i *)(dst + begin), _mm_or_si128(_mm_andnot_si128(keep, out), _mm_and_si128(keep, d)));
+  }
+
+  return begin;
+}
+
+__attribute__((target("avx2"))) static inline __m256i scale_avx2(__m256i d, __m256i s) {
+  auto alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+  auto t = _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), alpha)), _mm256_set1_epi16(255 / 2));
+  return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), _mm256_set1_epi16(1)), 8);
+}
+
+__attribute__((target("avx2"))) static int over_avx2(const std::uint32_t *src, std::uint32_t *dst, int begin, int end) {
+  auto zero   = _mm256_setzero_si256();
+  auto opaque = _mm256_set1_epi32(0xFF000000);
+
+  for(; begin + 8 <= end; begin += 8) {
+    auto s = _mm256_loadu_si256((const __m256i *)(src + begin));
+
+    if(_mm256_testz_si256(s, s)) {
+      continue;
+    }
+
+    auto is_opaque = _mm256_cmpeq_epi32(_mm256_and_si256(s, opaque), opaque);
+    if(_mm256_movemask_epi8(is_opaque) == -1) {
+      _mm256_storeu_si256((__m256i *)(dst + begin), s);
+      continue;
+    }
+
+    auto d = _mm256_loadu_si256((const __m256i *)(dst + begin));
+
+    // unpack and pack both work within 128 bit lanes, so the pixels end up in their original order
+    auto lo = scale_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero));
+    auto hi = scale_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero));
+
+    auto out  = _mm256_add_epi8(_mm256_packus_epi16(lo, hi), s);
+    auto keep = _mm256_andnot_si256(is_opaque, opaque);
+
+    _mm256_storeu_si256((__m256i *)(dst + begin), _mm256_blendv_epi8(out, d, keep));
+  }
+
+  return begin;
+}
+#endif
+
+#ifdef SUNSHINE_BLEND_NEON
+static inline uint8x8_t scale_neon(uint8x8_t d, uint8x8_t inv_alpha) {
+  auto t = vaddq_u16(vmull_u8(d, inv_alpha), vdupq_n_u16(255 / 2));
+  return vshrn_n_u16(vaddq_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), vdupq_n_u16(1)), 8);
+}
+
+static int over_neon(const std::uint32_t *src, std::uint32_t *dst, int begin, int end) {
+  auto opaque = vdupq_n_u32(0xFF000000);
+
+  for(; begin + 4 <= end; begin += 4) {
+    auto s = vld1q_u32(src + begin);
+
+    if(!vmaxvq_u32(s)) {
+      continue;
+    }
+
+    auto is_opaque = vceqq_u32(vandq_u32(s, opaque), opaque);
+    if(vminvq_u32(is_opaque) == 0xFFFFFFFF) {
+      vst1q_u32(dst + begin, s);
+      continue;
+    }
+
+    auto d = vld1q_u32(dst + begin);
+
+    // 255 - alpha, broadcast to each channel of the pixel
+    auto inv_alpha = vmvnq_u8(vreinterpretq_u8_u32(vmulq_n_u32(vshrq_n_u32(s, 24), 0x01010101)));
+
+    auto d8 = vreinterpretq_u8_u32(d);
+    auto lo = scale_neon(vget_low_u8(d8), vget_low_u8(inv_alpha));
+    auto hi = scale_neon(vget_high_u8(d8), vget_high_u8(inv_alpha));
+
+    auto out  = vreinterpretq_u32_u8(vaddq_u8(vcombine_u8(lo, hi), vreinterpretq_u8_u32(s)));
+    auto keep = vbicq_u32(opaque, is_opaque);
+
+    vst1q_u32(dst + begin, vbslq_u32(keep, d, out));
+  }
+
+  return begin;
+}
+#endif
+
+/**
+ * Kernels ordered from widest to narrowest, the narrower ones blend what remains of the row.
+ * The list always ends with over_scalar
+ */
+static over_f kernels[4] {
+  over_scalar
+};
+static std::string_view kernels_name = "scalar"sv;
+
+void init() {
+  auto kernel = std::begin(kernels);
+  auto push   = [&kernel](over_f over, const std::string_view &over_name) {
+    if(kernel == std::begin(kernels)) {
+      kernels_name = over_name;
+    }
+
+    *kernel++ = over;
+  };
+
+#if defined(SUNSHINE_BLEND_X86)
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2")) {
+    push(over_avx2, "AVX2"sv);
+  }
+
+  if(__builtin_cpu_supports("sse2")) {
+    push(over_sse2, "SSE2"sv);
+  }
+#elif defined(SUNSHINE_BLEND_NEON)
+  push(over_neon, "NEON"sv);
+#endif
+
+  *kernel = over_scalar;
+
+  BOOST_LOG(info) << "Cursor blending: using "sv << kernels_name;
+}
+
+std::string_view name() {
+  return kernels_name;
+}
+
+void over(const std::uint32_t *src, std::uint32_t *dst, int count) {
+  int begin = 0;
+  for(auto kernel = std::begin(kernels); begin < count; ++kernel) {
+    begin = (*kernel)(src, dst, begin, count);
+  }
+}
+} // namespace blend
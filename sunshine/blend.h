@@ -0,0 +1,35 @@
+#ifndef SUNSHINE_BLEND_H
+#define SUNSHINE_BLEND_H
+
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Vectorized alpha blending of the cursor into captured frames.
+ *
+ * The division by 255 is replaced by the exact multiply-shift (t + (t >> 8) + 1) >> 8,
+ * so every implementation generates the exact same pixels.
+ */
+namespace blend {
+/**
+ * Select the fastest implementation supported by the cpu.
+ * Must be called before over()
+ */
+void init();
+
+/**
+ * returns the name of the selected implementation
+ */
+std::string_view name();
+
+/**
+ * Blend count premultiplied ARGB pixels over dst:
+ *   dst.bgr = src.bgr + dst.bgr * (255 - src.a) / 255
+ *
+ * dst keeps its own alpha, unless src is fully opaque.
+ * Fully transparent pixels are skipped.
+ */
+void over(const std::uint32_t *src, std::uint32_t *dst, int count);
+} // namespace blend
+
+#endif //SUNSHINE_BLEND_H
@@ -171,6 +171,7 @@ video_t video {
   {
     "superfast"s,   // preset
     "zerolatency"s, // tune
+    false,          // ref_invalidation
   },                // software
 
   {
@@ -184,9 +185,10 @@ video_t video {
     std::nullopt,
     -1 }, // amd
 
-  {}, // encoder
-  {}, // adapter_name
-  {}, // output_name
+  {},   // encoder
+  {},   // adapter_name
+  {},   // output_name
+  false // capture_pipeline
 };
 
 audio_t audio {};
@@ -196,8 +198,15 @@ stream_t stream {
 
   APPS_JSON_PATH,
 
-  20, // fecPercentage
-  1   // channels
+  20,    // fecPercentage
+  20,    // min_fec_percentage
+  20,    // max_fec_percentage
+  2,     // fec_threads
+  1,     // channels
+  false, // udp_gso
+  0,     // pacing
+  100,   // min_bitrate_percentage
+  true,  // drop_oldest
 };
 
 nvhttp_t nvhttp {
@@ -671,6 +680,7 @@ void apply_config(std::unordered_map<std::string, std::string> &&vars) {
   int_between_f(vars, "hevc_mode", video.hevc_mode, { 0, 3 });
   string_f(vars, "sw_preset", video.sw.preset);
   string_f(vars, "sw_tune", video.sw.tune);
+  bool_f(vars, "sw_ref_invalidation", video.sw.ref_invalidation);
   int_f(vars, "nv_preset", video.nv.preset, nv::preset_from_view);
   int_f(vars, "nv_rc", video.nv.rc, nv::rc_from_view);
   int_f(vars, "nv_coder", video.nv.coder, nv::coder_from_view);
@@ -688,6 +698,7 @@ void apply_config(std::unordered_map<std::string, std::string> &&vars) {
   string_f(vars, "encoder", video.encoder);
   string_f(vars, "adapter_name", video.adapter_name);
   string_f(vars, "output_name", video.output_name);
+  bool_f(vars, "capture_pipeline", video.capture_pipeline);
 
   path_f(vars, "pkey", nvhttp.pkey);
   path_f(vars, "cert", nvhttp.cert);
@@ -720,6 +731,29 @@ void apply_config(std::unordered_map<std::string, std::string> &&vars) {
   path_f(vars, "file_apps", stream.file_apps);
   int_between_f(vars, "fec_percentage", stream.fec_percentage, { 1, 255 });
 
+  // Without bounds, the FEC percentage is fixed
+  stream.min_fec_percentage = stream.fec_percentage;
+  stream.max_fec_percentage = stream.fec_percentage;
+  int_between_f(vars, "min_fec_percentage", stream.min_fec_percentage, { 0, 255 });
+  int_between_f(vars, "max_fec_percentage", stream.max_fec_percentage, { 0, 255 });
+  if(stream.min_fec_percentage > stream.max_fec_percentage) {
+    std::cout << "Warning: min_fec_percentage is larger than max_fec_percentage, using a fixed FEC percentage"sv << std::endl;
+
+    stream.min_fec_percentage = stream.max_fec_percentage = stream.fec_percentage;
+  }
+  stream.fec_percentage = std::clamp(stream.fec_percentage, stream.min_fec_percentage, stream.max_fec_percentage);
+
+  int_between_f(vars, "fec_threads", stream.fec_threads, { 0, 64 });
+  bool_f(vars, "udp_gso", stream.udp_gso);
+  int_between_f(vars, "pacing", stream.pacing, { 0, 100 });
+  int_between_f(vars, "min_bitrate_percentage", stream.min_bitrate_percentage, { 1, 100 });
+
+  std::string queue_overflow;
+  string_restricted_f(vars, "queue_overflow", queue_overflow, { "drop_oldest"sv, "drop_newest"sv });
+  if(!queue_overflow.empty()) {
+    stream.drop_oldest = queue_overflow == "drop_oldest"sv;
+  }
+
   map_int_int_f(vars, "keybindings"s, input.keybindings);
 
   // This config option will only be used by the UI
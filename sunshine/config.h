@@ -19,6 +19,9 @@ struct video_t {
   struct {
     std::string preset;
     std::string tune;
+
+    // Invalidate lost reference frames instead of requesting a keyframe, this relies on the internals of libavcodec
+    bool ref_invalidation;
   } sw;
 
   struct {
@@ -37,6 +40,9 @@ struct video_t {
   std::string encoder;
   std::string adapter_name;
   std::string output_name;
+
+  // Let the X server copy the next frame while the previous one is handed to the encoder
+  bool capture_pipeline;
 };
 
 struct audio_t {
@@ -51,8 +57,29 @@ struct stream_t {
 
   int fec_percentage;
 
+  // Bounds of the FEC percentage, adjusted for each session by the packet loss it reports
+  // When they're equal, fec_percentage is used as is
+  int min_fec_percentage;
+  int max_fec_percentage;
+
+  // Threads encoding the FEC blocks of large frames in parallel, 0 encodes them one after another
+  int fec_threads;
+
   // max unique instances of video and audio streams
   int channels;
+
+  // Let the kernel split each FEC block into video packets
+  bool udp_gso;
+
+  // Percentage of the frame interval the packets of a frame are spread over, 0 disables pacing
+  int pacing;
+
+  // Percentage of the bitrate requested by the client the encoder may go down to when the link is congested
+  // 100 keeps the bitrate fixed
+  int min_bitrate_percentage;
+
+  // What a full media queue drops: the oldest element, sparing the newest keyframe, or the element being queued
+  bool drop_oldest;
 };
 
 struct nvhttp_t {
@@ -0,0 +1,230 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SUNSHINE_GF256_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SUNSHINE_GF256_NEON
+#endif
+
+#include "gf256.h"
+#include "main.h"
+
+using namespace std::literals;
+namespace gf256 {
+// Encodes the parity shards for the bytes [begin, end) of each shard
+// returns the offset of the first byte it didn't encode
+using row_f = int (*)(const std::uint8_t *coefs, std::uint8_t **data, int data_shards, std::uint8_t *out, int begin, int end);
+
+/**
+ * For each constant c:
+ *   [0, 16)  --> c * x        for x in [0, 16)
+ *   [16, 32) --> c * (x << 4) for x in [0, 16)
+ */
+alignas(64) static std::uint8_t mul_tables[256][32];
+
+static std::uint8_t mul_slow(std::uint8_t a, std::uint8_t b) {
+  std::uint8_t product = 0;
+
+  while(b) {
+    if(b & 1) {
+      product ^= a;
+    }
+
+    // Reduce by the polynomial used by rs.c: x^8 + x^4 + x^3 + x^2 + 1
+    a = (a << 1) ^ ((a & 0x80) ? 0x1D : 0);
+    b >>= 1;
+  }
+
+  return product;
+}
+
+static inline std::uint8_t mul(const std::uint8_t *table, std::uint8_t x) {
+  return table[x & 0x0F] ^ table[16 + (x >> 4)];
+}
+
+static int row_scalar(const std::uint8_t *coefs, std::uint8_t **data, int data_shards, std::uint8_t *out, int begin, int end) {
+  for(auto x = begin; x < end; ++x) {
+    std::uint8_t acc = 0;
+    for(auto c = 0; c < data_shards; ++c) {
+      acc ^= mul(mul_tables[coefs[c]], data[c][x]);
+    }
+
+    out[x] = acc;
+  }
+
+  return end;
+}
+
+#ifdef SUNSHINE_GF256_X86
+__attribute__((target("ssse3"))) static int row_ssse3(const std::uint8_t *coefs, std::uint8_t **data, int data_shards, std::uint8_t *out, int begin, int end) {
+  auto mask = _mm_set1_epi8(0x0F);
+
+  for(; begin + 16 <= end; begin += 16) {
+    auto acc = _mm_setzero_si128();
+    for(auto c = 0; c < data_shards; ++c) {
+      auto table = mul_tables[coefs[c]];
+
+      auto lo = _mm_load_si128((const __m128i *)table);
+      auto hi = _mm_load_si128((const __m128i *)(table + 16));
+
+      auto x = _mm_loadu_si128((const __m128i *)(data[c] + begin));
+
+      acc = _mm_xor_si128(acc, _mm_shuffle_epi8(lo, _mm_and_si128(x, mask)));
+      acc = _mm_xor_si128(acc, _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+    }
+
+    _mm_storeu_si128((__m128i *)(out + begin), acc);
+  }
+
+  return begin;
+}
+
+__attribute__((target("avx2"))) static int row_avx2(const std::uint8_t *coefs, std::uint8_t **data, int data_shards, std::uint8_t *out, int begin, int end) {
+  auto mask = _mm256_set1_epi8(0x0F);
+
+  for(; begin + 32 <= end; begin += 32) {
+    auto acc = _mm256_setzero_si256();
+    for(auto c = 0; c < data_shards; ++c) {
+      auto table = mul_tables[coefs[c]];
+
+      auto lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)table));
+      auto hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(table + 16)));
+
+      auto x = _mm256_loadu_si256((const __m256i *)(data[c] + begin));
+
+      acc = _mm256_xor_si256(acc, _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)));
+      acc = _mm256_xor_si256(acc, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+    }
+
+    _mm256_storeu_si256((__m256i *)(out + begin), acc);
+  }
+
+  return begin;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static int row_avx512(const std::uint8_t *coefs, std::uint8_t **data, int data_shards, std::uint8_t *out, int begin, int end) {
+  auto mask = _mm512_set1_epi8(0x0F);
+
+  for(; begin + 64 <= end; begin += 64) {
+    auto acc = _mm512_setzero_si512();
+    for(auto c = 0; c < data_shards; ++c) {
+      auto table = mul_tables[coefs[c]];
+
+      auto lo = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)table));
+      auto hi = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)(table + 16)));
+
+      auto x = _mm512_loadu_si512((const void *)(data[c] + begin));
+
+      acc = _mm512_xor_si512(acc, _mm512_shuffle_epi8(lo, _mm512_and_si512(x, mask)));
+      acc = _mm512_xor_si512(acc, _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi64(x, 4), mask)));
+    }
+
+    _mm512_storeu_si512((void *)(out + begin), acc);
+  }
+
+  return begin;
+}
+#endif
+
+#ifdef SUNSHINE_GF256_NEON
+static int row_neon(const std::uint8_t *coefs, std::uint8_t **data, int data_shards, std::uint8_t *out, int begin, int end) {
+  auto mask = vdupq_n_u8(0x0F);
+
+  for(; begin + 16 <= end; begin += 16) {
+    auto acc = vdupq_n_u8(0);
+    for(auto c = 0; c < data_shards; ++c) {
+      auto table = mul_tables[coefs[c]];
+
+      auto lo = vld1q_u8(table);
+      auto hi = vld1q_u8(table + 16);
+
+      auto x = vld1q_u8(data[c] + begin);
+
+      acc = veorq_u8(acc, vqtbl1q_u8(lo, vandq_u8(x, mask)));
+      acc = veorq_u8(acc, vqtbl1q_u8(hi, vshrq_n_u8(x, 4)));
+    }
+
+    vst1q_u8(out + begin, acc);
+  }
+
+  return begin;
+}
+#endif
+
+/**
+ * Kernels ordered from widest to narrowest, the narrower ones encode what remains of the shards.
+ * The list always ends with row_scalar
+ */
+static row_f rows[4] {
+  row_scalar
+};
+static std::string_view rows_name = "scalar"sv;
+
+void init() {
+  for(auto c = 0; c < 256; ++c) {
+    for(auto x = 0; x < 16; ++x) {
+      mul_tables[c][x]      = mul_slow(c, x);
+      mul_tables[c][16 + x] = mul_slow(c, x << 4);
+    }
+  }
+
+  auto row  = std::begin(rows);
+  auto push = [&row](row_f kernel, const std::string_view &kernel_name) {
+    if(row == std::begin(rows)) {
+      rows_name = kernel_name;
+    }
+
+    *row++ = kernel;
+  };
+
+#if defined(SUNSHINE_GF256_X86)
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx512bw")) {
+    push(row_avx512, "AVX512"sv);
+  }
+
+  if(__builtin_cpu_supports("avx2")) {
+    push(row_avx2, "AVX2"sv);
+  }
+
+  if(__builtin_cpu_supports("ssse3")) {
+    push(row_ssse3, "SSSE3"sv);
+  }
+#elif defined(SUNSHINE_GF256_NEON)
+  push(row_neon, "NEON"sv);
+#endif
+
+  *row = row_scalar;
+
+  BOOST_LOG(info) << "Reed-Solomon encoder: using "sv << rows_name;
+}
+
+std::string_view name() {
+  return rows_name;
+}
+
+void encode(reed_solomon *rs, std::uint8_t **shards, int nr_shards, int block_size) {
+  // rs.c interleaves multiple groups of shards, that layout is never used for streaming
+  if(nr_shards != rs->shards) {
+    reed_solomon_encode(rs, shards, nr_shards, block_size);
+
+    return;
+  }
+
+  auto data_shards   = rs->data_shards;
+  auto parity_shards = rs->parity_shards;
+
+  for(auto x = 0; x < parity_shards; ++x) {
+    auto coefs = rs->parity + x * data_shards;
+    auto out   = shards[data_shards + x];
+
+    int begin = 0;
+    for(auto row = std::begin(rows); begin < block_size; ++row) {
+      begin = (*row)(coefs, shards, data_shards, out, begin, block_size);
+    }
+  }
+}
+} // namespace gf256
@@ -0,0 +1,36 @@
+#ifndef SUNSHINE_GF256_H
+#define SUNSHINE_GF256_H
+
+#include <cstdint>
+#include <string_view>
+
+extern "C" {
+#include <rs.h>
+}
+
+/**
+ * Vectorized multiply-accumulate in GF(2^8) for the Reed-Solomon encoder.
+ *
+ * Multiplication by a constant is split into a lookup of the low and the high nibble,
+ * which fit in a single 16 byte shuffle: pshufb on x86 and tbl on aarch64.
+ */
+namespace gf256 {
+/**
+ * Select the fastest implementation supported by the cpu.
+ * Must be called after reed_solomon_init() and before encode()
+ */
+void init();
+
+/**
+ * returns the name of the selected implementation
+ */
+std::string_view name();
+
+/**
+ * Drop-in replacement for reed_solomon_encode(), generating the exact same parity shards.
+ * shards --> data shards followed by the parity shards of rs
+ */
+void encode(reed_solomon *rs, std::uint8_t **shards, int nr_shards, int block_size);
+} // namespace gf256
+
+#endif //SUNSHINE_GF256_H
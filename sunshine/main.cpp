@@ -16,8 +16,11 @@
 #include <boost/log/sinks.hpp>
 #include <boost/log/sources/severity_logger.hpp>
 
+#include "bench.h"
+#include "blend.h"
 #include "config.h"
 #include "confighttp.h"
+#include "gf256.h"
 #include "httpcommon.h"
 #include "main.h"
 #include "nvhttp.h"
@@ -25,6 +28,7 @@
 #include "thread_pool.h"
 #include "upnp.h"
 #include "video.h"
+#include "yuv.h"
 #include "version.h"
 
 #include "platform/common.h"
@@ -63,6 +67,7 @@ void print_help(const char *name) {
     << "    Any configurable option can be overwritten with: \"name=value\""sv << std::endl
     << std::endl
     << "    --help                    | print help"sv << std::endl
+    << "    --bench [name...]         | run microbenchmarks" << std::endl
     << "    --creds username password | set user credentials for the Web manager" << std::endl
     << "    --version                 | print the version of sunshine" << std::endl
     << std::endl
@@ -119,6 +124,7 @@ int entry(const char *name, int argc, char *argv[]) {
 } // namespace gen_creds
 
 std::map<std::string_view, std::function<int(const char *name, int argc, char **argv)>> cmd_to_func {
+  { "bench"sv, bench::entry },
   { "creds"sv, gen_creds::entry },
   { "help"sv, help::entry },
   { "version"sv, version::entry }
@@ -257,6 +263,9 @@ int main(int argc, char *argv[]) {
   }
 
   reed_solomon_init();
+  gf256::init();
+  blend::init();
+  yuv::init();
   auto input_deinit_guard = input::init();
   if(video::init()) {
     return 2;
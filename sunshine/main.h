@@ -49,6 +49,9 @@ MAIL(switch_display);
 // Local mail
 MAIL(touch_port);
 MAIL(idr);
+MAIL(invalidate_ref_frames);
+MAIL(bitrate);
+MAIL(bitrate_fixed);
 MAIL(rumble);
 #undef MAIL
 } // namespace mail
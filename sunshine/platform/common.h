@@ -6,6 +6,7 @@
 #define SUNSHINE_COMMON_H
 
 #include <bitset>
+#include <chrono>
 #include <filesystem>
 #include <functional>
 #include <mutex>
@@ -273,6 +274,39 @@ std::string get_mac_address(const std::string_view &address);
 std::string from_sockaddr(const sockaddr *const);
 std::pair<std::uint16_t, std::string> from_sockaddr_ex(const sockaddr *const);
 
+struct batched_send_info_t {
+  // block_count blocks of block_size bytes, stored back to back
+  const char *buffer;
+  std::size_t block_size;
+  std::size_t block_count;
+
+  std::uintptr_t native_socket;
+  const sockaddr *target_address;
+  std::size_t target_address_size;
+
+  // Hand multiple blocks at once to the kernel, which splits them into datagrams
+  // This is reset to false when the network interface turns out not to support it
+  bool segmentation_offload;
+};
+
+/**
+ * Send each block of send_info as a separate datagram, using as few system calls as possible
+ *
+ * Returns the number of system calls on success
+ * Returns -1 on failure
+ */
+int send_batch(batched_send_info_t &send_info);
+
+/**
+ * Returns true if the socket supports batched_send_info_t::segmentation_offload
+ */
+bool udp_segmentation_supported(std::uintptr_t native_socket);
+
+/**
+ * Sleep until deadline, with a precision of tens of microseconds rather than milliseconds
+ */
+void sleep_until(std::chrono::steady_clock::time_point deadline);
+
 std::unique_ptr<audio_control_t> audio_control();
 
 /**
@@ -11,6 +11,7 @@ extern "C" {
 
 #include "cuda.h"
 #include "graphics.h"
+#include "misc.h"
 #include "sunshine/main.h"
 #include "sunshine/utility.h"
 #include "wayland.h"
@@ -478,7 +479,7 @@ public:
   }
 
   platf::capture_e capture(snapshot_cb_t &&snapshot_cb, std::shared_ptr<platf::img_t> img, bool *cursor) override {
-    auto next_frame = std::chrono::steady_clock::now();
+    platf::frame_clock_t frame_clock { delay };
 
     // Force display_t::capture to initialize handle_t::capture
     cursor_visible = !*cursor;
@@ -489,15 +490,7 @@ public:
     });
 
     while(img) {
-      auto now = std::chrono::steady_clock::now();
-      if(next_frame > now) {
-        std::this_thread::sleep_for((next_frame - now) / 3 * 2);
-      }
-      while(next_frame > now) {
-        std::this_thread::sleep_for(1ns);
-        now = std::chrono::steady_clock::now();
-      }
-      next_frame = now + delay;
+      frame_clock.wait();
 
       auto status = snapshot(img.get(), 150ms, *cursor);
       switch(status) {
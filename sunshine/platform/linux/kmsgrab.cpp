@@ -15,6 +15,7 @@
 
 // Cursor rendering support through x11
 #include "graphics.h"
+#include "misc.h"
 #include "vaapi.h"
 #include "wayland.h"
 #include "x11grab.h"
@@ -657,19 +658,10 @@ public:
   }
 
   capture_e capture(snapshot_cb_t &&snapshot_cb, std::shared_ptr<img_t> img, bool *cursor) override {
-    auto next_frame = std::chrono::steady_clock::now();
+    platf::frame_clock_t frame_clock { delay };
 
     while(img) {
-      auto now = std::chrono::steady_clock::now();
-
-      if(next_frame > now) {
-        std::this_thread::sleep_for((next_frame - now) / 3 * 2);
-      }
-      while(next_frame > now) {
-        std::this_thread::sleep_for(1ns);
-        now = std::chrono::steady_clock::now();
-      }
-      next_frame = now + delay;
+      frame_clock.wait();
 
       auto status = snapshot(img.get(), 1000ms, *cursor);
       switch(status) {
@@ -778,19 +770,10 @@ public:
   }
 
   capture_e capture(snapshot_cb_t &&snapshot_cb, std::shared_ptr<img_t> img, bool *cursor) {
-    auto next_frame = std::chrono::steady_clock::now();
+    platf::frame_clock_t frame_clock { delay };
 
     while(img) {
-      auto now = std::chrono::steady_clock::now();
-
-      if(next_frame > now) {
-        std::this_thread::sleep_for((next_frame - now) / 3 * 2);
-      }
-      while(next_frame > now) {
-        std::this_thread::sleep_for(1ns);
-        now = std::chrono::steady_clock::now();
-      }
-      next_frame = now + delay;
+      frame_clock.wait();
 
       auto status = snapshot(img.get(), 1000ms, *cursor);
       switch(status) {
@@ -2,9 +2,14 @@
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <pwd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <cstring>
 #include <fstream>
 
 #include "graphics.h"
@@ -14,6 +19,15 @@
 #include "sunshine/main.h"
 #include "sunshine/platform/common.h"
 
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+// Available since Linux 4.18
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
 #ifdef __GNUC__
 #define SUNSHINE_GNUC_EXTENSION __extension__
 #else
@@ -140,6 +154,192 @@ std::string get_mac_address(const std::string_view &address) {
   return "00:00:00:00:00:00"s;
 }
 
+int send_batch(batched_send_info_t &send_info) {
+  auto sockfd = (int)send_info.native_socket;
+
+  // Enough for a complete FEC block in a single call
+  constexpr std::size_t max_batch = 256;
+
+  // Limits of a single datagram with UDP_SEGMENT
+  constexpr std::size_t max_gso_segments = 64;
+  constexpr std::size_t max_gso_size     = 65507;
+
+  mmsghdr msgs[max_batch];
+  iovec iovs[max_batch];
+
+  union {
+    char buf[CMSG_SPACE(sizeof(std::uint16_t))];
+    cmsghdr alignment;
+  } cmsgs[max_batch];
+
+  int syscalls     = 0;
+  std::size_t next = 0;
+  while(next < send_info.block_count) {
+    std::size_t segments = 1;
+    if(send_info.segmentation_offload) {
+      segments = std::clamp(max_gso_size / send_info.block_size, (std::size_t)1, max_gso_segments);
+    }
+
+    std::size_t batch = 0;
+    for(auto block = next; block < send_info.block_count && batch < max_batch; ++batch) {
+      auto blocks = std::min(segments, send_info.block_count - block);
+
+      iovs[batch].iov_base = (void *)(send_info.buffer + block * send_info.block_size);
+      iovs[batch].iov_len  = blocks * send_info.block_size;
+
+      auto &msg = msgs[batch];
+
+      msg                     = {};
+      msg.msg_hdr.msg_name    = (void *)send_info.target_address;
+      msg.msg_hdr.msg_namelen = send_info.target_address_size;
+      msg.msg_hdr.msg_iov     = &iovs[batch];
+      msg.msg_hdr.msg_iovlen  = 1;
+
+      if(send_info.segmentation_offload) {
+        msg.msg_hdr.msg_control    = cmsgs[batch].buf;
+        msg.msg_hdr.msg_controllen = sizeof(cmsgs[batch].buf);
+
+        auto cmsg        = CMSG_FIRSTHDR(&msg.msg_hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type  = UDP_SEGMENT;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(std::uint16_t));
+
+        *(std::uint16_t *)CMSG_DATA(cmsg) = send_info.block_size;
+      }
+
+      block += blocks;
+    }
+
+    auto sent = sendmmsg(sockfd, msgs, batch, 0);
+    ++syscalls;
+
+    if(sent < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      // The socket is in non-blocking mode, because it's also used for asynchronous reads
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        pollfd pfd { sockfd, POLLOUT, 0 };
+        if(poll(&pfd, 1, 1000) == 1 && !(pfd.revents & (POLLERR | POLLNVAL))) {
+          continue;
+        }
+      }
+
+      // The network interface doesn't support segmentation offload
+      if(errno == EIO && send_info.segmentation_offload) {
+        BOOST_LOG(warning) << "UDP segmentation offload failed, falling back to a datagram per packet"sv;
+
+        send_info.segmentation_offload = false;
+        continue;
+      }
+
+      BOOST_LOG(error) << "sendmmsg() failed: "sv << std::strerror(errno);
+      return -1;
+    }
+
+    for(auto x = 0; x < sent; ++x) {
+      next += iovs[x].iov_len / send_info.block_size;
+    }
+  }
+
+  return syscalls;
+}
+
+bool udp_segmentation_supported(std::uintptr_t native_socket) {
+  int segment_size;
+  socklen_t size = sizeof(segment_size);
+
+  return getsockopt((int)native_socket, SOL_UDP, UDP_SEGMENT, &segment_size, &size) == 0;
+}
+
+void sleep_until(std::chrono::steady_clock::time_point deadline) {
+  // By default, the kernel may delay the wakeup of a thread by up to 50us to coalesce timers
+  thread_local auto timer_slack = prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+  (void)timer_slack;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+
+  // std::chrono::steady_clock is CLOCK_MONOTONIC
+  timespec ts;
+  ts.tv_sec  = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+}
+
+// Never spin longer than this, even if the wakeups are very late.
+// With the timer slack lowered, the absolute deadline of the sleep is usually met well within it
+constexpr auto max_spin = 50us;
+
+// A frame this late is counted as a late frame
+constexpr auto late_threshold = 1ms;
+
+frame_clock_t::frame_clock_t(std::chrono::nanoseconds interval)
+    : interval { interval },
+      next { std::chrono::steady_clock::now() },
+      oversleep { 0 },
+      spin { 20us },
+      last_report { next },
+      jitter_total { 0 },
+      jitter_max { 0 },
+      frames { 0 },
+      late_frames { 0 } {}
+
+void frame_clock_t::wait() {
+  auto now = std::chrono::steady_clock::now();
+
+  if(next - now > spin) {
+    auto wakeup = next - spin;
+    sleep_until(wakeup);
+
+    now = std::chrono::steady_clock::now();
+
+    // Spin a little longer than the average lateness of a wakeup
+    oversleep = (oversleep * 7 + (now - wakeup)) / 8;
+    spin      = std::min<std::chrono::nanoseconds>(oversleep * 2, max_spin);
+  }
+
+  while(now < next) {
+    now = std::chrono::steady_clock::now();
+  }
+
+  auto jitter = now - next;
+
+  jitter_total += jitter;
+  jitter_max = std::max<std::chrono::nanoseconds>(jitter_max, jitter);
+  ++frames;
+  if(jitter > late_threshold) {
+    ++late_frames;
+  }
+
+  // Frames that are missed entirely aren't made up for
+  next += interval;
+  if(next < now) {
+    next = now + interval;
+  }
+
+  report(now);
+}
+
+void frame_clock_t::report(std::chrono::steady_clock::time_point now) {
+  if(now - last_report < report_interval) {
+    return;
+  }
+
+  BOOST_LOG(debug)
+    << "Capture: frame jitter average ["sv << std::chrono::duration_cast<std::chrono::microseconds>(jitter_total / frames).count()
+    << "us], max ["sv << std::chrono::duration_cast<std::chrono::microseconds>(jitter_max).count()
+    << "us], ["sv << late_frames << '/' << frames << "] frames late by more than 1ms, spinning ["sv
+    << std::chrono::duration_cast<std::chrono::microseconds>(spin).count() << "us]"sv;
+
+  last_report  = now;
+  jitter_total = 0ns;
+  jitter_max   = 0ns;
+  frames       = 0;
+  late_frames  = 0;
+}
+
 namespace source {
 enum source_e : std::size_t {
 #ifdef SUNSHINE_BUILD_CUDA
@@ -2,6 +2,8 @@
 #define SUNSHINE_PLATFORM_MISC_H
 
 #include <unistd.h>
+
+#include <chrono>
 #include <vector>
 
 #include "sunshine/utility.h"
@@ -28,4 +30,42 @@ void *handle(const std::vector<const char *> &libs);
 
 } // namespace dyn
 
+namespace platf {
+/**
+ * Paces the frames of a capture backend.
+ *
+ * Deadlines are absolute, so the time spent capturing a frame doesn't delay the frames after it.
+ * The thread sleeps until shortly before a deadline, then spins the rest of the way.
+ * How long it spins is calibrated to how late the thread wakes up, up to 50us.
+ */
+class frame_clock_t {
+public:
+  static constexpr auto report_interval = std::chrono::seconds { 10 };
+
+  explicit frame_clock_t(std::chrono::nanoseconds interval);
+
+  /**
+   * Block until the next frame is due
+   */
+  void wait();
+
+private:
+  void report(std::chrono::steady_clock::time_point now);
+
+  std::chrono::nanoseconds interval;
+  std::chrono::steady_clock::time_point next;
+
+  // The average lateness of a wakeup, and how long before a deadline to stop sleeping
+  std::chrono::nanoseconds oversleep;
+  std::chrono::nanoseconds spin;
+
+  // Lateness of the frames since the last report
+  std::chrono::steady_clock::time_point last_report;
+  std::chrono::nanoseconds jitter_total;
+  std::chrono::nanoseconds jitter_max;
+  std::uint64_t frames;
+  std::uint64_t late_frames;
+};
+} // namespace platf
+
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "sunshine/platform/common.h"
 
 #include "sunshine/main.h"
+#include "misc.h"
 #include "vaapi.h"
 #include "wayland.h"
 
@@ -115,18 +116,10 @@ public:
 class wlr_ram_t : public wlr_t {
 public:
   platf::capture_e capture(snapshot_cb_t &&snapshot_cb, std::shared_ptr<platf::img_t> img, bool *cursor) override {
-    auto next_frame = std::chrono::steady_clock::now();
+    platf::frame_clock_t frame_clock { delay };
 
     while(img) {
-      auto now = std::chrono::steady_clock::now();
-
-      if(next_frame > now) {
-        std::this_thread::sleep_for((next_frame - now) / 3 * 2);
-      }
-      while(next_frame > now) {
-        now = std::chrono::steady_clock::now();
-      }
-      next_frame = now + delay;
+      frame_clock.wait();
 
       auto status = snapshot(img.get(), 1000ms, *cursor);
       switch(status) {
@@ -214,18 +207,10 @@ public:
 class wlr_vram_t : public wlr_t {
 public:
   platf::capture_e capture(snapshot_cb_t &&snapshot_cb, std::shared_ptr<platf::img_t> img, bool *cursor) override {
-    auto next_frame = std::chrono::steady_clock::now();
+    platf::frame_clock_t frame_clock { delay };
 
     while(img) {
-      auto now = std::chrono::steady_clock::now();
-
-      if(next_frame > now) {
-        std::this_thread::sleep_for((next_frame - now) / 3 * 2);
-      }
-      while(next_frame > now) {
-        now = std::chrono::steady_clock::now();
-      }
-      next_frame = now + delay;
+      frame_clock.wait();
 
       auto status = snapshot(img.get(), 1000ms, *cursor);
       switch(status) {
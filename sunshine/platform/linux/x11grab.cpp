@@ -9,6 +9,8 @@
 #include <X11/X.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XInput2.h>
+#include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xrandr.h>
 #include <sys/ipc.h>
@@ -16,6 +18,7 @@
 #include <xcb/shm.h>
 #include <xcb/xfixes.h>
 
+#include "sunshine/blend.h"
 #include "sunshine/config.h"
 #include "sunshine/main.h"
 #include "sunshine/task_pool.h"
@@ -56,6 +59,18 @@ _FN(GetWindowAttributes, Status,
 _FN(CloseDisplay, int, (Display * display));
 _FN(Free, int, (void *data));
 _FN(InitThreads, Status, (void));
+_FN(CheckTypedEvent, Bool, (Display * display, int event_type, XEvent *event_return));
+_FN(GetEventData, Bool, (Display * display, XGenericEventCookie *cookie));
+_FN(FreeEventData, void, (Display * display, XGenericEventCookie *cookie));
+_FN(QueryExtension, Bool, (Display * display, _Xconst char *name, int *major_opcode_return, int *first_event_return, int *first_error_return));
+_FN(QueryPointer, Bool,
+  (
+    Display * display,
+    Window w,
+    Window *root_return, Window *child_return,
+    int *root_x_return, int *root_y_return,
+    int *win_x_return, int *win_y_return,
+    unsigned int *mask_return));
 
 namespace rr {
 _FN(GetScreenResources, XRRScreenResources *, (Display * dpy, Window window));
@@ -98,6 +113,11 @@ int init() {
 } // namespace rr
 namespace fix {
 _FN(GetCursorImage, XFixesCursorImage *, (Display * dpy));
+_FN(QueryExtension, Bool, (Display * dpy, int *event_base_return, int *error_base_return));
+_FN(SelectCursorInput, void, (Display * dpy, Window win, unsigned long eventMask));
+_FN(CreateRegion, XserverRegion, (Display * dpy, XRectangle *rectangles, int nrectangles));
+_FN(DestroyRegion, void, (Display * dpy, XserverRegion region));
+_FN(FetchRegion, XRectangle *, (Display * dpy, XserverRegion region, int *nrectanglesRet));
 
 int init() {
   static void *handle { nullptr };
@@ -114,6 +134,11 @@ int init() {
 
   std::vector<std::tuple<dyn::apiproc *, const char *>> funcs {
     { (dyn::apiproc *)&GetCursorImage, "XFixesGetCursorImage" },
+    { (dyn::apiproc *)&QueryExtension, "XFixesQueryExtension" },
+    { (dyn::apiproc *)&SelectCursorInput, "XFixesSelectCursorInput" },
+    { (dyn::apiproc *)&CreateRegion, "XFixesCreateRegion" },
+    { (dyn::apiproc *)&DestroyRegion, "XFixesDestroyRegion" },
+    { (dyn::apiproc *)&FetchRegion, "XFixesFetchRegion" },
   };
 
   if(dyn::load(handle, funcs)) {
@@ -125,6 +150,72 @@ int init() {
 }
 } // namespace fix
 
+namespace damage {
+_FN(QueryExtension, Bool, (Display * dpy, int *event_base_return, int *error_base_return));
+_FN(Create, Damage, (Display * dpy, Drawable drawable, int level));
+_FN(Subtract, void, (Display * dpy, Damage damage, XserverRegion repair, XserverRegion parts));
+_FN(Destroy, void, (Display * dpy, Damage damage));
+
+int init() {
+  static void *handle { nullptr };
+  static bool funcs_loaded = false;
+
+  if(funcs_loaded) return 0;
+
+  if(!handle) {
+    handle = dyn::handle({ "libXdamage.so.1", "libXdamage.so" });
+    if(!handle) {
+      return -1;
+    }
+  }
+
+  std::vector<std::tuple<dyn::apiproc *, const char *>> funcs {
+    { (dyn::apiproc *)&QueryExtension, "XDamageQueryExtension" },
+    { (dyn::apiproc *)&Create, "XDamageCreate" },
+    { (dyn::apiproc *)&Subtract, "XDamageSubtract" },
+    { (dyn::apiproc *)&Destroy, "XDamageDestroy" },
+  };
+
+  if(dyn::load(handle, funcs)) {
+    return -1;
+  }
+
+  funcs_loaded = true;
+  return 0;
+}
+} // namespace damage
+
+namespace xi {
+_FN(QueryVersion, Status, (Display * dpy, int *major_version_inout, int *minor_version_inout));
+_FN(SelectEvents, int, (Display * dpy, Window win, XIEventMask *masks, int num_masks));
+
+int init() {
+  static void *handle { nullptr };
+  static bool funcs_loaded = false;
+
+  if(funcs_loaded) return 0;
+
+  if(!handle) {
+    handle = dyn::handle({ "libXi.so.6", "libXi.so" });
+    if(!handle) {
+      return -1;
+    }
+  }
+
+  std::vector<std::tuple<dyn::apiproc *, const char *>> funcs {
+    { (dyn::apiproc *)&QueryVersion, "XIQueryVersion" },
+    { (dyn::apiproc *)&SelectEvents, "XISelectEvents" },
+  };
+
+  if(dyn::load(handle, funcs)) {
+    return -1;
+  }
+
+  funcs_loaded = true;
+  return 0;
+}
+} // namespace xi
+
 int init() {
   static void *handle { nullptr };
   static bool funcs_loaded = false;
@@ -145,6 +236,11 @@ int init() {
     { (dyn::apiproc *)&Free, "XFree" },
     { (dyn::apiproc *)&CloseDisplay, "XCloseDisplay" },
     { (dyn::apiproc *)&InitThreads, "XInitThreads" },
+    { (dyn::apiproc *)&CheckTypedEvent, "XCheckTypedEvent" },
+    { (dyn::apiproc *)&GetEventData, "XGetEventData" },
+    { (dyn::apiproc *)&FreeEventData, "XFreeEventData" },
+    { (dyn::apiproc *)&QueryExtension, "XQueryExtension" },
+    { (dyn::apiproc *)&QueryPointer, "XQueryPointer" },
   };
 
   if(dyn::load(handle, funcs)) {
@@ -182,6 +278,8 @@ _FN(shm_attach, xcb_void_cookie_t,
     uint32_t shmid,
     uint8_t read_only));
 
+_FN(shm_detach, xcb_void_cookie_t, (xcb_connection_t * c, xcb_shm_seg_t shmseg));
+
 _FN(get_extension_data, xcb_query_extension_reply_t *,
   (xcb_connection_t * c, xcb_extension_t *ext));
 
@@ -191,6 +289,8 @@ _FN(connection_has_error, int, (xcb_connection_t * c));
 _FN(connect, xcb_connection_t *, (const char *displayname, int *screenp));
 _FN(setup_roots_iterator, xcb_screen_iterator_t, (const xcb_setup_t *R));
 _FN(generate_id, std::uint32_t, (xcb_connection_t * c));
+_FN(flush, int, (xcb_connection_t * c));
+_FN(discard_reply, void, (xcb_connection_t * c, unsigned int sequence));
 
 int init_shm() {
   static void *handle { nullptr };
@@ -210,6 +310,7 @@ int init_shm() {
     { (dyn::apiproc *)&shm_get_image_reply, "xcb_shm_get_image_reply" },
     { (dyn::apiproc *)&shm_get_image_unchecked, "xcb_shm_get_image_unchecked" },
     { (dyn::apiproc *)&shm_attach, "xcb_shm_attach" },
+    { (dyn::apiproc *)&shm_detach, "xcb_shm_detach" },
   };
 
   if(dyn::load(handle, funcs)) {
@@ -241,6 +342,8 @@ int init() {
     { (dyn::apiproc *)&connect, "xcb_connect" },
     { (dyn::apiproc *)&setup_roots_iterator, "xcb_setup_roots_iterator" },
     { (dyn::apiproc *)&generate_id, "xcb_generate_id" },
+    { (dyn::apiproc *)&flush, "xcb_flush" },
+    { (dyn::apiproc *)&discard_reply, "xcb_discard_reply" },
   };
 
   if(dyn::load(handle, funcs)) {
@@ -257,7 +360,6 @@ int init() {
 void freeImage(XImage *);
 void freeX(XFixesCursorImage *);
 
-using xcb_connect_t = util::dyn_safe_ptr<xcb_connection_t, &xcb::disconnect>;
 using xcb_img_t     = util::c_ptr<xcb_shm_get_image_reply_t>;
 
 using ximg_t    = util::safe_ptr<XImage, freeImage>;
@@ -306,62 +408,238 @@ struct x11_img_t : public img_t {
   ximg_t img;
 };
 
+/**
+ * The X server writes directly into the SHM segment of the image
+ */
 struct shm_img_t : public img_t {
   ~shm_img_t() override {
-    delete[] data;
+    if(seg) {
+      xcb::shm_detach(xcb.get(), seg);
+    }
+
+    // Owned by shm_data
     data = nullptr;
   }
-};
 
-static void blend_cursor(Display *display, img_t &img, int offsetX, int offsetY) {
-  xcursor_t overlay { x11::fix::GetCursorImage(display) };
+  // Keeps the connection alive until the segment is detached
+  std::shared_ptr<xcb_connection_t> xcb;
+  std::uint32_t seg {};
 
-  if(!overlay) {
-    BOOST_LOG(error) << "Couldn't get cursor from XFixesGetCursorImage"sv;
+  shm_id_t shm_id;
+  shm_data_t shm_data;
+
+  // The number of the frame held by the image, 0 if it holds none
+  std::uint64_t frame_nr {};
+
+  // The rows the cursor was blended into
+  std::pair<int, int> cursor_rows {};
+};
+
+/**
+ * Sort and merge overlapping rows [first, second), so each row appears once
+ */
+static void merge_rows(std::vector<std::pair<int, int>> &rows) {
+  if(rows.empty()) {
     return;
   }
 
-  overlay->x -= overlay->xhot;
-  overlay->y -= overlay->yhot;
+  std::sort(std::begin(rows), std::end(rows));
+
+  auto merged = std::begin(rows);
+  for(auto it = std::next(merged); it != std::end(rows); ++it) {
+    if(it->first <= merged->second) {
+      merged->second = std::max(merged->second, it->second);
+    }
+    else {
+      *++merged = *it;
+    }
+  }
+
+  rows.erase(std::next(merged), std::end(rows));
+}
+
+/**
+ * A decoded copy of the cursor, the image is only fetched again from the X server when the shape changes.
+ * With XInput2, the position is only queried after the pointer moved.
+ */
+class cursor_cache_t {
+public:
+  void init(Display *display) {
+    this->display = display;
 
-  overlay->x -= offsetX;
-  overlay->y -= offsetY;
+    auto root = DefaultRootWindow(display);
 
-  overlay->x = std::max((short)0, overlay->x);
-  overlay->y = std::max((short)0, overlay->y);
+    int error_base;
+    if(x11::fix::QueryExtension(display, &fixes_event, &error_base)) {
+      x11::fix::SelectCursorInput(display, root, XFixesDisplayCursorNotifyMask);
+    }
+    else {
+      fixes_event = -1;
+    }
 
-  auto pixels = (int *)img.data;
+    int event_base, major = 2, minor = 0;
+    if(x11::xi::init() ||
+       !x11::QueryExtension(display, "XInputExtension", &xi_opcode, &event_base, &error_base) ||
+       x11::xi::QueryVersion(display, &major, &minor) != Success) {
+      BOOST_LOG(info) << "XInput2 not available, querying the cursor position every frame"sv;
 
-  auto screen_height = img.height;
-  auto screen_width  = img.width;
+      xi_opcode = -1;
+      return;
+    }
 
-  auto delta_height = std::min<uint16_t>(overlay->height, std::max(0, screen_height - overlay->y));
-  auto delta_width  = std::min<uint16_t>(overlay->width, std::max(0, screen_width - overlay->x));
-  for(auto y = 0; y < delta_height; ++y) {
-    auto overlay_begin = &overlay->pixels[y * overlay->width];
-    auto overlay_end   = &overlay->pixels[y * overlay->width + delta_width];
+    std::uint8_t mask[XIMaskLen(XI_RawMotion)] {};
+    XISetMask(mask, XI_RawMotion);
 
-    auto pixels_begin = &pixels[(y + overlay->y) * (img.row_pitch / img.pixel_pitch) + overlay->x];
+    XIEventMask event_mask { XIAllMasterDevices, sizeof(mask), mask };
+    x11::xi::SelectEvents(display, root, &event_mask, 1);
+  }
 
-    std::for_each(overlay_begin, overlay_end, [&](long pixel) {
-      int *pixel_p = (int *)&pixel;
+  /**
+   * Process the cursor events received since the previous call
+   * returns true if the cursor moved, changed shape or visibility
+   */
+  bool update() {
+    XEvent event;
+    while(fixes_event >= 0 && x11::CheckTypedEvent(display, fixes_event + XFixesCursorNotify, &event)) {
+      shape_dirty = true;
+    }
 
-      auto colors_in = (uint8_t *)pixels_begin;
+    // Raw motion doesn't follow pointer warps, so keep querying until the pointer holds still
+    auto moved = xi_opcode < 0 || moving;
+    while(xi_opcode >= 0 && x11::CheckTypedEvent(display, GenericEvent, &event)) {
+      auto &cookie = event.xcookie;
+      moved        = moved || cookie.extension == xi_opcode;
 
-      auto alpha = (*(uint *)pixel_p) >> 24u;
-      if(alpha == 255) {
-        *pixels_begin = *pixel_p;
+      // Otherwise Xlib keeps the data of the event around
+      if(x11::GetEventData(display, &cookie)) {
+        x11::FreeEventData(display, &cookie);
       }
-      else {
-        auto colors_out = (uint8_t *)pixel_p;
-        colors_in[0]    = colors_out[0] + (colors_in[0] * (255 - alpha) + 255 / 2) / 255;
-        colors_in[1]    = colors_out[1] + (colors_in[1] * (255 - alpha) + 255 / 2) / 255;
-        colors_in[2]    = colors_out[2] + (colors_in[2] * (255 - alpha) + 255 / 2) / 255;
+    }
+
+    auto prev_visible = visible;
+    auto prev_serial  = serial;
+    auto prev_x       = x;
+    auto prev_y       = y;
+
+    if(shape_dirty || fixes_event < 0) {
+      fetch();
+    }
+    else if(moved) {
+      Window root, child;
+      int root_x, root_y, win_x, win_y;
+      unsigned int mask;
+      if(x11::QueryPointer(display, DefaultRootWindow(display), &root, &child, &root_x, &root_y, &win_x, &win_y, &mask)) {
+        x = root_x - xhot;
+        y = root_y - yhot;
       }
-      ++pixels_begin;
-    });
+    }
+
+    moving = x != prev_x || y != prev_y;
+
+    return moving || visible != prev_visible || serial != prev_serial;
   }
-}
+
+  /**
+   * Blend the cursor into the image
+   *
+   * img <-- destination image
+   * offsetX, offsetY <--- Top left corner of the virtual screen
+   *
+   * returns the rows [first, second) of img the cursor was blended into
+   */
+  std::pair<int, int> blend(img_t &img, int offsetX, int offsetY) const {
+    if(!visible) {
+      return {};
+    }
+
+    auto overlay_x = std::max(0, x - offsetX);
+    auto overlay_y = std::max(0, y - offsetY);
+
+    auto screen_height = img.height;
+    auto screen_width  = img.width;
+
+    auto delta_height = std::min(height, std::max(0, screen_height - overlay_y));
+    auto delta_width  = std::min(width, std::max(0, screen_width - overlay_x));
+    for(auto row = 0; row < delta_height; ++row) {
+      auto [begin, end] = spans[row];
+
+      end = std::min(end, delta_width);
+      if(begin >= end) {
+        continue;
+      }
+
+      auto pixels_begin = (std::uint32_t *)(img.data + (row + overlay_y) * img.row_pitch) + overlay_x;
+
+      blend::over(&pixels[row * width + begin], pixels_begin + begin, end - begin);
+    }
+
+    return { overlay_y, overlay_y + delta_height };
+  }
+
+  // Top left corner of the cursor on the virtual screen
+  int x = 0, y = 0;
+  int width = 0, height = 0;
+
+  unsigned long serial = 0;
+  bool visible         = false;
+
+  // Premultiplied ARGB
+  std::vector<std::uint32_t> pixels;
+
+  // The columns [first, second) of each row hold all pixels that aren't fully transparent
+  std::vector<std::pair<int, int>> spans;
+
+private:
+  void fetch() {
+    xcursor_t overlay { x11::fix::GetCursorImage(display) };
+
+    visible = (bool)overlay;
+    if(!overlay) {
+      BOOST_LOG(error) << "Couldn't get cursor from XFixesGetCursorImage"sv;
+      return;
+    }
+
+    shape_dirty = false;
+
+    xhot = overlay->xhot;
+    yhot = overlay->yhot;
+    x    = overlay->x - xhot;
+    y    = overlay->y - yhot;
+
+    if(overlay->cursor_serial == serial && !pixels.empty()) {
+      return;
+    }
+
+    width  = overlay->width;
+    height = overlay->height;
+    serial = overlay->cursor_serial;
+
+    // XFixes hands out the pixels as longs
+    pixels.resize(width * height);
+    std::copy_n(overlay->pixels, pixels.size(), std::begin(pixels));
+
+    spans.resize(height);
+    for(auto row = 0; row < height; ++row) {
+      auto row_begin = std::begin(pixels) + row * width;
+      auto row_end   = row_begin + width;
+
+      auto first = std::find_if(row_begin, row_end, [](auto pixel) { return pixel != 0; });
+      auto last  = std::find_if(std::make_reverse_iterator(row_end), std::make_reverse_iterator(first), [](auto pixel) { return pixel != 0; }).base();
+
+      spans[row] = { first - row_begin, last - row_begin };
+    }
+  }
+
+  Display *display = nullptr;
+
+  int fixes_event = -1;
+  int xi_opcode   = -1;
+
+  int xhot = 0, yhot = 0;
+
+  bool shape_dirty = true;
+  bool moving      = true;
+};
 
 struct x11_attr_t : public display_t {
   std::chrono::nanoseconds delay;
@@ -370,6 +648,8 @@ struct x11_attr_t : public display_t {
   Window xwindow;
   XWindowAttributes xattr;
 
+  cursor_cache_t cursor_cache;
+
   mem_type_e mem_type;
 
   /*
@@ -393,6 +673,7 @@ struct x11_attr_t : public display_t {
     xwindow = DefaultRootWindow(xdisplay.get());
 
     refresh();
+    cursor_cache.init(cursor_display());
 
     int streamedMonitor = -1;
     if(!display_name.empty()) {
@@ -448,6 +729,13 @@ struct x11_attr_t : public display_t {
     return 0;
   }
 
+  /**
+   * The connection of the capture thread, the cursor is queried on it
+   */
+  virtual Display *cursor_display() {
+    return xdisplay.get();
+  }
+
   /**
    * Called when the display attributes should change.
    */
@@ -456,19 +744,10 @@ struct x11_attr_t : public display_t {
   }
 
   capture_e capture(snapshot_cb_t &&snapshot_cb, std::shared_ptr<img_t> img, bool *cursor) override {
-    auto next_frame = std::chrono::steady_clock::now();
+    platf::frame_clock_t frame_clock { delay };
 
     while(img) {
-      auto now = std::chrono::steady_clock::now();
-
-      if(next_frame > now) {
-        std::this_thread::sleep_for((next_frame - now) / 3 * 2);
-      }
-      while(next_frame > now) {
-        std::this_thread::sleep_for(1ns);
-        now = std::chrono::steady_clock::now();
-      }
-      next_frame = now + delay;
+      frame_clock.wait();
 
       auto status = snapshot(img.get(), 1000ms, *cursor);
       switch(status) {
@@ -509,7 +788,8 @@ struct x11_attr_t : public display_t {
     img_out->img.reset(img);
 
     if(cursor) {
-      blend_cursor(xdisplay.get(), *img_out_base, offset_x, offset_y);
+      cursor_cache.update();
+      cursor_cache.blend(*img_out_base, offset_x, offset_y);
     }
 
     return capture_e::ok;
@@ -541,13 +821,25 @@ struct x11_attr_t : public display_t {
 
 struct shm_attr_t : public x11_attr_t {
   x11::xdisplay_t shm_xdisplay; // Prevent race condition with x11_attr_t::xdisplay
-  xcb_connect_t xcb;
+  std::shared_ptr<xcb_connection_t> xcb;
   xcb_screen_t *display;
-  std::uint32_t seg;
 
-  shm_id_t shm_id;
+  // Damage to the root window since the previous frame, 0 without XDamage
+  Damage damage {};
+  XserverRegion damage_region {};
+  int damage_event;
 
-  shm_data_t data;
+  // Each image still holds an older frame, it only fetches the rows damaged since that frame
+  static constexpr auto damage_history_size = 16;
+  std::array<std::vector<std::pair<int, int>>, damage_history_size> damage_history;
+  std::uint64_t frame_nr = 0;
+
+  std::vector<std::pair<int, int>> damaged_rows;
+  std::vector<std::pair<int, int>> fetch_rows;
+  std::vector<xcb_shm_get_image_cookie_t> cookies;
+
+  // Whether the cursor was blended into the previous frame
+  bool blended_cursor = false;
 
   util::TaskPool::task_id_t refresh_task_id;
 
@@ -561,69 +853,239 @@ struct shm_attr_t : public x11_attr_t {
     refresh_task_id = task_pool.pushDelayed(&shm_attr_t::delayed_refresh, 2s, this).task_id;
   }
 
+  /**
+   * The task pool refreshes xattr on xdisplay, so the capture thread queries the cursor on its own connection
+   */
+  Display *cursor_display() override {
+    return shm_xdisplay.get();
+  }
+
   ~shm_attr_t() override {
     while(!task_pool.cancel(refresh_task_id))
       ;
+
+    if(damage) {
+      x11::damage::Destroy(shm_xdisplay.get(), damage);
+      x11::fix::DestroyRegion(shm_xdisplay.get(), damage_region);
+    }
   }
 
   capture_e capture(snapshot_cb_t &&snapshot_cb, std::shared_ptr<img_t> img, bool *cursor) override {
-    auto next_frame = std::chrono::steady_clock::now();
+    platf::frame_clock_t frame_clock { delay };
+
+    // The X server copies the next frame into spare, while the sessions are handed the frame in img
+    std::shared_ptr<img_t> spare;
+    if(config::video.capture_pipeline) {
+      spare = alloc_img();
+      if(!spare) {
+        return capture_e::error;
+      }
+    }
+
+    // Whether spare is requested already
+    auto pending = false;
+
+    // Don't leave the replies of a pending frame queued on the connection
+    auto fg = util::fail_guard([this]() {
+      discard();
+    });
 
     while(img) {
-      auto now = std::chrono::steady_clock::now();
+      frame_clock.wait();
 
-      if(next_frame > now) {
-        std::this_thread::sleep_for((next_frame - now) / 3 * 2);
+      if(pending) {
+        pending = false;
+        img.swap(spare);
       }
-      while(next_frame > now) {
-        std::this_thread::sleep_for(1ns);
-        now = std::chrono::steady_clock::now();
+      else {
+        auto status = request(img.get(), *cursor);
+        switch(status) {
+        case platf::capture_e::reinit:
+        case platf::capture_e::error:
+          return status;
+        case platf::capture_e::timeout:
+          std::this_thread::sleep_for(1ms);
+          continue;
+        case platf::capture_e::ok:
+          break;
+        default:
+          BOOST_LOG(error) << "Unrecognized capture status ["sv << (int)status << ']';
+          return status;
+        }
       }
-      next_frame = now + delay;
 
-      auto status = snapshot(img.get(), 1000ms, *cursor);
-      switch(status) {
-      case platf::capture_e::reinit:
-      case platf::capture_e::error:
+      auto status = finish(img.get());
+      if(status != platf::capture_e::ok) {
         return status;
-      case platf::capture_e::timeout:
-        std::this_thread::sleep_for(1ms);
-        continue;
-      case platf::capture_e::ok:
-        img = snapshot_cb(img);
+      }
+
+      // Request the next frame before handing this one over, so the copy overlaps the handoff
+      if(spare) {
+        status = request(spare.get(), *cursor);
+        if(status == platf::capture_e::reinit || status == platf::capture_e::error) {
+          return status;
+        }
+
+        pending = status == platf::capture_e::ok;
+      }
+
+      auto next = snapshot_cb(img);
+      if(!next) {
         break;
-      default:
-        BOOST_LOG(error) << "Unrecognized capture status ["sv << (int)status << ']';
-        return status;
       }
+
+      // While pending, img is swapped with spare before the next frame
+      img = std::move(next);
     }
 
     return capture_e::ok;
   }
 
-  capture_e snapshot(img_t *img, std::chrono::milliseconds timeout, bool cursor) {
+  /**
+   * Request the rows of the next frame img doesn't hold yet, without waiting for the X server to copy them.
+   * returns capture_e::timeout if nothing changed since the previous frame
+   */
+  capture_e request(img_t *img, bool cursor) {
     //The whole X server changed, so we gotta reinit everything
     if(xattr.width != env_width || xattr.height != env_height) {
       BOOST_LOG(warning) << "X dimensions changed in SHM mode, request reinit"sv;
       return capture_e::reinit;
     }
-    else {
-      auto img_cookie = xcb::shm_get_image_unchecked(xcb.get(), display->root, offset_x, offset_y, width, height, ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, seg, 0);
 
+    collect_damage();
+
+    auto cursor_changed = (cursor && cursor_cache.update()) || cursor != blended_cursor;
+    blended_cursor      = cursor;
+
+    // Nothing changed on screen, the sessions keep encoding the previous frame
+    if(frame_nr && !cursor_changed && damaged_rows.empty()) {
+      return capture_e::timeout;
+    }
+
+    damage_history[++frame_nr % damage_history_size].swap(damaged_rows);
+
+    auto shm_img = (shm_img_t *)img;
+    collect_rows(*shm_img);
+
+    // Full rows keep the layout of the SHM segment
+    discard();
+    for(auto &[begin, end] : fetch_rows) {
+      cookies.emplace_back(xcb::shm_get_image_unchecked(
+        xcb.get(), display->root, offset_x, offset_y + begin, width, end - begin, ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, shm_img->seg, begin * img->row_pitch));
+    }
+
+    // Otherwise the requests sit in the output buffer until finish() waits for the replies
+    xcb::flush(xcb.get());
+
+    // Until every reply arrived, the image holds a mix of frames
+    shm_img->frame_nr = 0;
+
+    return capture_e::ok;
+  }
+
+  /**
+   * Wait for the X server to copy the rows requested by request(), then blend the cursor
+   */
+  capture_e finish(img_t *img) {
+    auto failed = false;
+    for(auto &img_cookie : cookies) {
       xcb_img_t img_reply { xcb::shm_get_image_reply(xcb.get(), img_cookie, nullptr) };
-      if(!img_reply) {
-        BOOST_LOG(error) << "Could not get image reply"sv;
-        return capture_e::reinit;
+      failed = failed || !img_reply;
+    }
+    cookies.clear();
+
+    if(failed) {
+      BOOST_LOG(error) << "Could not get image reply"sv;
+      return capture_e::reinit;
+    }
+
+    auto shm_img         = (shm_img_t *)img;
+    shm_img->frame_nr    = frame_nr;
+    shm_img->cursor_rows = {};
+
+    if(blended_cursor) {
+      shm_img->cursor_rows = cursor_cache.blend(*img, offset_x, offset_y);
+    }
+
+    return capture_e::ok;
+  }
+
+  /**
+   * Drop the replies of the rows requested by request() that finish() didn't wait for
+   */
+  void discard() {
+    for(auto &img_cookie : cookies) {
+      xcb::discard_reply(xcb.get(), img_cookie.sequence);
+    }
+    cookies.clear();
+  }
+
+  /**
+   * Collect the rows img has to fetch to hold the current frame:
+   * the rows damaged since its frame and the rows of its cursor
+   */
+  void collect_rows(const shm_img_t &img) {
+    fetch_rows.clear();
+
+    if(!img.frame_nr || frame_nr - img.frame_nr > damage_history_size) {
+      fetch_rows.emplace_back(0, height);
+      return;
+    }
+
+    for(auto x = img.frame_nr + 1; x <= frame_nr; ++x) {
+      auto &rows = damage_history[x % damage_history_size];
+      fetch_rows.insert(std::end(fetch_rows), std::begin(rows), std::end(rows));
+    }
+
+    if(img.cursor_rows.first < img.cursor_rows.second) {
+      fetch_rows.emplace_back(img.cursor_rows);
+    }
+
+    merge_rows(fetch_rows);
+  }
+
+  /**
+   * Collect the rows of the monitor damaged since the previous frame,
+   * without XDamage that's every row
+   */
+  void collect_damage() {
+    damaged_rows.clear();
+
+    if(!damage) {
+      damaged_rows.emplace_back(0, height);
+      return;
+    }
+
+    // The events only tell the damage is no longer empty, the damage itself is fetched below
+    XEvent event;
+    while(x11::CheckTypedEvent(shm_xdisplay.get(), damage_event + XDamageNotify, &event)) {}
+
+    x11::damage::Subtract(shm_xdisplay.get(), damage, None, damage_region);
+
+    int count         = 0;
+    XRectangle *rects = x11::fix::FetchRegion(shm_xdisplay.get(), damage_region, &count);
+    auto fg           = util::fail_guard([rects]() {
+      if(rects) {
+        x11::Free(rects);
       }
+    });
 
-      std::copy_n((std::uint8_t *)data.data, frame_size(), img->data);
+    for(auto x = 0; x < count; ++x) {
+      auto &rect = rects[x];
 
-      if(cursor) {
-        blend_cursor(shm_xdisplay.get(), *img, offset_x, offset_y);
+      // Damage to other monitors
+      if(rect.x >= offset_x + width || rect.x + rect.width <= offset_x) {
+        continue;
       }
 
-      return capture_e::ok;
+      auto begin = std::max(rect.y - offset_y, 0);
+      auto end   = std::min(rect.y + rect.height - offset_y, height);
+      if(begin < end) {
+        damaged_rows.emplace_back(begin, end);
+      }
     }
+
+    merge_rows(damaged_rows);
   }
 
   std::shared_ptr<img_t> alloc_img() override {
@@ -632,7 +1094,24 @@ struct shm_attr_t : public x11_attr_t {
     img->height      = height;
     img->pixel_pitch = 4;
     img->row_pitch   = img->pixel_pitch * width;
-    img->data        = new std::uint8_t[height * img->row_pitch];
+
+    img->shm_id.id = shmget(IPC_PRIVATE, frame_size(), IPC_CREAT | 0777);
+    if(img->shm_id.id == -1) {
+      BOOST_LOG(error) << "shmget failed"sv;
+      return nullptr;
+    }
+
+    img->shm_data.data = shmat(img->shm_id.id, nullptr, 0);
+    if((uintptr_t)img->shm_data.data == -1) {
+      BOOST_LOG(error) << "shmat failed"sv;
+      return nullptr;
+    }
+
+    img->xcb = xcb;
+    img->seg = xcb::generate_id(xcb.get());
+    xcb::shm_attach(xcb.get(), img->seg, img->shm_id.id, false);
+
+    img->data = (std::uint8_t *)img->shm_data.data;
 
     return img;
   }
@@ -642,12 +1121,16 @@ struct shm_attr_t : public x11_attr_t {
   }
 
   int init(const std::string &display_name, int framerate) {
+    if(!shm_xdisplay) {
+      BOOST_LOG(error) << "Could not open X11 display for SHM"sv;
+      return -1;
+    }
+
     if(x11_attr_t::init(display_name, framerate)) {
       return 1;
     }
 
-    shm_xdisplay.reset(x11::OpenDisplay(nullptr));
-    xcb.reset(xcb::connect(nullptr, nullptr));
+    xcb = std::shared_ptr<xcb_connection_t> { xcb::connect(nullptr, nullptr), xcb::disconnect };
     if(xcb::connection_has_error(xcb.get())) {
       return -1;
     }
@@ -660,23 +1143,17 @@ struct shm_attr_t : public x11_attr_t {
 
     auto iter = xcb::setup_roots_iterator(xcb::get_setup(xcb.get()));
     display   = iter.data;
-    seg       = xcb::generate_id(xcb.get());
 
-    shm_id.id = shmget(IPC_PRIVATE, frame_size(), IPC_CREAT | 0777);
-    if(shm_id.id == -1) {
-      BOOST_LOG(error) << "shmget failed"sv;
-      return -1;
-    }
-
-    xcb::shm_attach(xcb.get(), seg, shm_id.id, false);
-    data.data = shmat(shm_id.id, nullptr, 0);
-
-    if((uintptr_t)data.data == -1) {
-      BOOST_LOG(error) << "shmat failed"sv;
+    int damage_error;
+    if(x11::damage::init() || !x11::damage::QueryExtension(shm_xdisplay.get(), &damage_event, &damage_error)) {
+      BOOST_LOG(info) << "XDamage not available, capturing every frame"sv;
 
-      return -1;
+      return 0;
     }
 
+    damage        = x11::damage::Create(shm_xdisplay.get(), DefaultRootWindow(shm_xdisplay.get()), XDamageReportNonEmpty);
+    damage_region = x11::fix::CreateRegion(shm_xdisplay.get(), nullptr, 0);
+
     return 0;
   }
 
@@ -779,6 +1256,11 @@ int load_x11() {
 }
 
 namespace x11 {
+struct cursor_ctx_raw_t {
+  xdisplay_t display;
+  cursor_cache_t cache;
+};
+
 std::optional<cursor_t> cursor_t::make() {
   if(load_x11()) {
     return std::nullopt;
@@ -786,40 +1268,49 @@ std::optional<cursor_t> cursor_t::make() {
 
   cursor_t cursor;
 
-  cursor.ctx.reset((cursor_ctx_t::pointer)x11::OpenDisplay(nullptr));
+  cursor.ctx.reset(new cursor_ctx_raw_t { OpenDisplay(nullptr) });
+  if(!cursor.ctx->display) {
+    return std::nullopt;
+  }
+
+  cursor.ctx->cache.init(cursor.ctx->display.get());
 
   return cursor;
 }
 
 void cursor_t::capture(egl::cursor_t &img) {
-  auto display = (xdisplay_t::pointer)ctx.get();
+  auto &cache = ctx->cache;
 
-  xcursor_t xcursor = fix::GetCursorImage(display);
+  cache.update();
 
-  if(img.serial != xcursor->cursor_serial) {
-    auto buf_size = xcursor->width * xcursor->height * sizeof(int);
+  if(!cache.visible) {
+    img.data = nullptr;
+    return;
+  }
+
+  if(img.serial != cache.serial) {
+    auto buf_size = cache.pixels.size() * sizeof(std::uint32_t);
 
     if(img.buffer.size() < buf_size) {
       img.buffer.resize(buf_size);
     }
 
-    std::transform(xcursor->pixels, xcursor->pixels + buf_size / 4, (int *)img.buffer.data(), [](long pixel) -> int {
-      return pixel;
-    });
+    std::copy_n((std::uint8_t *)cache.pixels.data(), buf_size, img.buffer.data());
   }
 
   img.data        = img.buffer.data();
-  img.width       = xcursor->width;
-  img.height      = xcursor->height;
-  img.x           = xcursor->x - xcursor->xhot;
-  img.y           = xcursor->y - xcursor->yhot;
+  img.width       = cache.width;
+  img.height      = cache.height;
+  img.x           = cache.x;
+  img.y           = cache.y;
   img.pixel_pitch = 4;
   img.row_pitch   = img.pixel_pitch * img.width;
-  img.serial      = xcursor->cursor_serial;
+  img.serial      = cache.serial;
 }
 
 void cursor_t::blend(img_t &img, int offsetX, int offsetY) {
-  blend_cursor((xdisplay_t::pointer)ctx.get(), img, offsetX, offsetY);
+  ctx->cache.update();
+  ctx->cache.blend(img, offsetX, offsetY);
 }
 
 xdisplay_t make_display() {
@@ -831,7 +1322,7 @@ void freeDisplay(_XDisplay *xdisplay) {
 }
 
 void freeCursorCtx(cursor_ctx_t::pointer ctx) {
-  CloseDisplay((xdisplay_t::pointer)ctx);
+  delete ctx;
 }
 } // namespace x11
 } // namespace platf
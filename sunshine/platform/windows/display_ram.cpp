@@ -1,4 +1,5 @@
 #include "display.h"
+#include "sunshine/blend.h"
 #include "sunshine/main.h"
 
 namespace platf {
@@ -75,22 +76,6 @@ void blend_cursor_monochrome(const cursor_t &cursor, img_t &img) {
   }
 }
 
-void apply_color_alpha(int *img_pixel_p, int cursor_pixel) {
-  auto colors_out = (std::uint8_t *)&cursor_pixel;
-  auto colors_in  = (std::uint8_t *)img_pixel_p;
-
-  //TODO: When use of IDXGIOutput5 is implemented, support different color formats
-  auto alpha = colors_out[3];
-  if(alpha == 255) {
-    *img_pixel_p = cursor_pixel;
-  }
-  else {
-    colors_in[0] = colors_out[0] + (colors_in[0] * (255 - alpha) + 255 / 2) / 255;
-    colors_in[1] = colors_out[1] + (colors_in[1] * (255 - alpha) + 255 / 2) / 255;
-    colors_in[2] = colors_out[2] + (colors_in[2] * (255 - alpha) + 255 / 2) / 255;
-  }
-}
-
 void apply_color_masked(int *img_pixel_p, int cursor_pixel) {
   //TODO: When use of IDXGIOutput5 is implemented, support different color formats
   auto alpha = ((std::uint8_t *)&cursor_pixel)[3];
@@ -137,13 +122,13 @@ void blend_cursor_color(const cursor_t &cursor, img_t &img, const bool masked) {
     auto cursor_end   = &cursor_begin[delta_width];
 
     auto img_pixel_p = &img_data[(i + img_skip_y) * (img.row_pitch / img.pixel_pitch) + img_skip_x];
+    if(!masked) {
+      blend::over((std::uint32_t *)cursor_begin, (std::uint32_t *)img_pixel_p, delta_width);
+      continue;
+    }
+
     std::for_each(cursor_begin, cursor_end, [&](int cursor_pixel) {
-      if(masked) {
-        apply_color_masked(img_pixel_p, cursor_pixel);
-      }
-      else {
-        apply_color_alpha(img_pixel_p, cursor_pixel);
-      }
+      apply_color_masked(img_pixel_p, cursor_pixel);
       ++img_pixel_p;
     });
   }
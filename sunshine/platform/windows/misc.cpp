@@ -1,6 +1,7 @@
 #include <filesystem>
 #include <iomanip>
 #include <sstream>
+#include <thread>
 
 
 // prevent clang format from "optimizing" the header include order
@@ -120,4 +121,67 @@ void print_status(const std::string_view &prefix, HRESULT status) {
 
   BOOST_LOG(error) << prefix << ": "sv << std::string_view { err_string, bytes };
 }
+
+int send_batch(batched_send_info_t &send_info) {
+  auto sock = (SOCKET)send_info.native_socket;
+
+  // There is no equivalent of sendmmsg() on Windows
+  for(auto x = 0; x < send_info.block_count;) {
+    auto status = sendto(sock,
+      send_info.buffer + x * send_info.block_size, (int)send_info.block_size, 0,
+      send_info.target_address, (int)send_info.target_address_size);
+
+    if(status == SOCKET_ERROR) {
+      auto err = WSAGetLastError();
+
+      // The socket is in non-blocking mode, because it's also used for asynchronous reads
+      if(err == WSAEWOULDBLOCK) {
+        WSAPOLLFD pfd { sock, POLLWRNORM, 0 };
+        if(WSAPoll(&pfd, 1, 1000) == 1 && !(pfd.revents & (POLLERR | POLLNVAL))) {
+          continue;
+        }
+      }
+
+      BOOST_LOG(error) << "sendto() failed: "sv << err;
+      return -1;
+    }
+
+    ++x;
+  }
+
+  return (int)send_info.block_count;
+}
+
+bool udp_segmentation_supported(std::uintptr_t native_socket) {
+  return false;
+}
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+using waitable_timer_t = util::safe_ptr_v2<void, BOOL, CloseHandle>;
+
+void sleep_until(std::chrono::steady_clock::time_point deadline) {
+  // Unlike Sleep(), a high resolution timer isn't bound to the 1ms+ resolution of the system timer
+  // It's only available since Windows 10, version 1803
+  thread_local waitable_timer_t timer { CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS) };
+
+  auto duration = deadline - std::chrono::steady_clock::now();
+  if(duration <= 0s) {
+    return;
+  }
+
+  // Negative values are relative, in units of 100ns
+  LARGE_INTEGER due_time;
+  due_time.QuadPart = -std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / 100;
+
+  if(!timer || !SetWaitableTimer(timer.get(), &due_time, 0, nullptr, nullptr, FALSE)) {
+    std::this_thread::sleep_until(deadline);
+
+    return;
+  }
+
+  WaitForSingleObject(timer.get(), INFINITE);
+}
 } // namespace platf
\ No newline at end of file
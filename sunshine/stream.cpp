@@ -5,6 +5,7 @@
 #include "process.h"
 
 #include <future>
+#include <list>
 #include <queue>
 
 #include <fstream>
@@ -17,6 +18,7 @@ extern "C" {
 }
 
 #include "config.h"
+#include "gf256.h"
 #include "input.h"
 #include "main.h"
 #include "network.h"
@@ -227,6 +229,381 @@ public:
   net::host_t _host;
 };
 
+namespace fec {
+using rs_t = util::safe_ptr<reed_solomon, reed_solomon_release>;
+
+/**
+ * reed_solomon_new builds and inverts the encoding matrix, far too expensive to do for every FEC block.
+ * The number of data and parity shards depends only on the size of the frame, so the same few
+ * encoders are needed over and over again.
+ *
+ * reed_solomon_encode doesn't modify the encoder, therefore a cached encoder can be used by multiple threads at once.
+ */
+class rs_cache_t {
+public:
+  using key_t = std::pair<int, int>;
+
+  explicit rs_cache_t(std::size_t max_elements) : _max_elements { max_elements }, _hits { 0 }, _misses { 0 } {}
+
+  /**
+   * returns the encoder for data_shards + parity_shards
+   * returns nullptr on error
+   */
+  std::shared_ptr<reed_solomon> get(int data_shards, int parity_shards) {
+    key_t key { data_shards, parity_shards };
+
+    std::lock_guard lg { _lock };
+
+    auto pos = std::find_if(std::begin(_lru), std::end(_lru), [&key](auto &el) {
+      return el.first == key;
+    });
+
+    if(pos != std::end(_lru)) {
+      ++_hits;
+
+      // Most recently used encoders are at the front
+      _lru.splice(std::begin(_lru), _lru, pos);
+
+      return _lru.front().second;
+    }
+
+    ++_misses;
+    BOOST_LOG(verbose) << "Reed-Solomon cache miss ["sv << data_shards << ':' << parity_shards << ']';
+
+    std::shared_ptr<reed_solomon> rs { reed_solomon_new(data_shards, parity_shards), reed_solomon_release };
+    if(!rs) {
+      return nullptr;
+    }
+
+    if(_lru.size() >= _max_elements) {
+      _lru.pop_back();
+    }
+
+    _lru.emplace_front(key, rs);
+
+    return rs;
+  }
+
+  std::uint64_t hits() const {
+    return _hits.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t misses() const {
+    return _misses.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::size_t _max_elements;
+
+  std::atomic<std::uint64_t> _hits;
+  std::atomic<std::uint64_t> _misses;
+
+  std::mutex _lock;
+  std::list<std::pair<key_t, std::shared_ptr<reed_solomon>>> _lru;
+};
+
+/**
+ * A few threads generating the parity shards of FEC blocks in parallel,
+ * while the thread sending the frame sends the data shards
+ */
+class pool_t {
+public:
+  // Tasks capture little enough to not allocate
+  using task_t = std::function<void()>;
+
+  /**
+   * max_tasks --> the maximum number of tasks waiting at any time
+   */
+  void start(int nr_threads, std::uint32_t max_tasks) {
+    _tasks = std::make_unique<safe::queue_t<task_t>>(max_tasks);
+
+    for(auto x = 0; x < nr_threads; ++x) {
+      _threads.emplace_back([this]() {
+        while(auto task = _tasks->pop()) {
+          (*task)();
+        }
+      });
+    }
+  }
+
+  /**
+   * Tasks still waiting are abandoned, the threads waiting for them must have ended already
+   */
+  void stop() {
+    if(_tasks) {
+      _tasks->stop();
+    }
+
+    for(auto &thread : _threads) {
+      thread.join();
+    }
+
+    _threads.clear();
+  }
+
+  bool empty() const {
+    return _threads.empty();
+  }
+
+  void push(task_t &&task) {
+    _tasks->raise(std::move(task));
+  }
+
+private:
+  std::unique_ptr<safe::queue_t<task_t>> _tasks;
+  std::vector<std::thread> _threads;
+};
+} // namespace fec
+
+/**
+ * Statistics of the video send path, shared by all sessions
+ * They're logged periodically, mostly at debug level
+ */
+struct video_stats_t {
+  static constexpr auto report_interval = 10s;
+
+  std::atomic<std::uint64_t> packets { 0 };
+  std::atomic<std::uint64_t> syscalls { 0 };
+  std::atomic<std::uint64_t> syscall_time { 0 }; // nanoseconds
+
+  // Frames that should have been protected by FEC, but weren't
+  std::atomic<std::uint64_t> frames_without_fec { 0 };
+
+  // Frames that got fewer parity shards than requested, to stay within DATA_SHARDS_MAX
+  std::atomic<std::uint64_t> frames_with_reduced_fec { 0 };
+  std::atomic<bool> warned_reduced_fec { false };
+
+  // Buffers allocated by the send path, zero in steady state
+  std::atomic<std::uint64_t> allocations { 0 };
+
+  std::mutex report_lock;
+  std::chrono::steady_clock::time_point last_report;
+
+  void report(std::chrono::steady_clock::time_point now) {
+    std::unique_lock ul { report_lock, std::try_to_lock };
+    if(!ul || now - last_report < report_interval) {
+      return;
+    }
+
+    last_report = now;
+
+    auto packets      = this->packets.exchange(0, std::memory_order_relaxed);
+    auto syscalls     = this->syscalls.exchange(0, std::memory_order_relaxed);
+    auto syscall_time = std::chrono::nanoseconds { this->syscall_time.exchange(0, std::memory_order_relaxed) };
+    auto allocations  = this->allocations.exchange(0, std::memory_order_relaxed);
+
+    if(auto frames_without_fec = this->frames_without_fec.exchange(0, std::memory_order_relaxed)) {
+      BOOST_LOG(warning) << "Video: ["sv << frames_without_fec << "] frames sent without error correction"sv;
+    }
+
+    if(auto frames_with_reduced_fec = this->frames_with_reduced_fec.exchange(0, std::memory_order_relaxed)) {
+      BOOST_LOG(info) << "Video: ["sv << frames_with_reduced_fec << "] frames sent with less error correction than requested"sv;
+    }
+
+    if(!syscalls) {
+      return;
+    }
+
+    BOOST_LOG(debug)
+      << "Video: sent ["sv << packets << "] packets in ["sv << syscalls << "] system calls :: "sv
+      << (double)packets / syscalls << " packets per call, "sv
+      << std::chrono::duration_cast<std::chrono::microseconds>(syscall_time / syscalls).count() << "us per call, "sv
+      << allocations << " buffer allocations"sv;
+  }
+};
+
+/**
+ * Token bucket spreading the shards of a frame over a fraction of the frame interval,
+ * instead of handing them to the network in a single burst.
+ */
+struct video_pacer_t {
+  // The number of packets that may be sent back-to-back
+  static constexpr std::size_t burst_packets = 16;
+
+  // Percentage of the frame interval a frame is spread over, 0 disables pacing
+  int percentage;
+
+  // bytes per second
+  double rate;
+
+  double tokens;
+  double burst;
+  std::chrono::steady_clock::time_point last_refill;
+
+  bool enabled() const {
+    return percentage > 0;
+  }
+
+  /**
+   * Derive the rate for the next frame
+   *
+   * frame_bytes --> the size of the frame, including headers and parity shards
+   * bitrate     --> kbps
+   */
+  void start_frame(std::size_t frame_bytes, int framerate, int bitrate, std::size_t blocksize) {
+    framerate = std::max(framerate, 1);
+
+    // seconds
+    auto window = percentage / (100.0 * framerate);
+
+    // Small frames are sent at the rate of a frame of the average size,
+    // large frames are never spread over more than the window
+    auto average_bytes = bitrate * 1000.0 / 8.0 / framerate;
+
+    rate  = std::max(average_bytes, (double)frame_bytes) / window;
+    burst = (double)(burst_packets * blocksize);
+  }
+
+  /**
+   * Block until bytes may be sent
+   */
+  void wait(std::size_t bytes) {
+    auto now = std::chrono::steady_clock::now();
+
+    tokens      = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last_refill).count());
+    last_refill = now;
+
+    tokens -= bytes;
+    if(tokens >= 0) {
+      return;
+    }
+
+    auto deadline = now + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(-tokens / rate));
+    platf::sleep_until(deadline);
+
+    // The tokens gained while sleeping paid off the debt
+    tokens      = 0;
+    last_refill = deadline;
+  }
+};
+
+/**
+ * Packetizes, encodes and sends the frames of the sessions assigned to it.
+ * The frames of a session are always handled by the same worker, so they're sent in order
+ */
+struct video_worker_t {
+  std::thread thread;
+
+  safe::spsc_ring_t<video::packet_t> packets;
+
+  // The number of sessions assigned to this worker
+  int sessions;
+};
+
+/**
+ * Turns the loss reported by a client into the FEC percentage of its video.
+ * The percentage goes up quickly on loss, and slowly back down once the loss stops
+ */
+struct fec_controller_t {
+  // How long there must be no loss before lowering the percentage
+  static constexpr auto hold = 2s;
+
+  // percentage points per second
+  static constexpr double decay = 2.0;
+
+  int min;
+  int max;
+
+  // Only used by the control thread
+  double current;
+  std::chrono::steady_clock::time_point last_loss;
+
+  // Read by the video thread for each frame
+  std::atomic<int> percentage;
+
+  void update(int loss_count, std::chrono::milliseconds interval, std::chrono::steady_clock::time_point now) {
+    if(min == max) {
+      return;
+    }
+
+    if(loss_count > 0) {
+      last_loss = now;
+
+      current = std::min<double>(max, std::max(current * 1.5, current + 5.0));
+    }
+    else if(now - last_loss > hold) {
+      current = std::max<double>(min, current - decay * std::chrono::duration<double>(interval).count());
+    }
+
+    auto new_percentage = (int)std::ceil(current);
+    if(percentage.exchange(new_percentage, std::memory_order_relaxed) != new_percentage) {
+      BOOST_LOG(debug) << "FEC percentage: "sv << new_percentage;
+    }
+  }
+};
+
+/**
+ * Lowers the bitrate of the encoder when the client loses packets or the frames of the session pile up,
+ * and raises it back to what the client asked for once the link recovers
+ */
+struct bitrate_controller_t {
+  // Give the encoder time to react before lowering the bitrate any further
+  static constexpr auto decrease_interval = 500ms;
+
+  // How long the link must be clean before raising the bitrate
+  static constexpr auto hold = 5s;
+  static constexpr auto increase_interval = 1s;
+
+  // kbps
+  int min;
+  int max;
+
+  // Written by the control thread, the video worker paces the frames of the session to it
+  std::atomic<int> current;
+
+  // Only used by the control thread
+  std::chrono::steady_clock::time_point last_change;
+  std::chrono::steady_clock::time_point last_congestion;
+
+  // The last frame handed to the video worker, and the last frame it has sent
+  std::atomic<std::int64_t> queued_pts;
+  std::atomic<std::int64_t> sent_pts;
+
+  safe::mail_raw_t::event_t<int> bitrate_events;
+
+  // Raised by the encoder if it can't change its bitrate
+  safe::mail_raw_t::event_t<bool> bitrate_fixed_events;
+
+  void update(int loss_count, std::chrono::steady_clock::time_point now) {
+    if(min == max) {
+      return;
+    }
+
+    if(bitrate_fixed_events->peek()) {
+      // The encoder ignored any change, it still encodes at the bitrate it started with
+      min = max;
+      current.store(max, std::memory_order_relaxed);
+      return;
+    }
+
+    // Besides the frame being sent, there are frames waiting
+    auto backlog = queued_pts.load(std::memory_order_relaxed) - sent_pts.load(std::memory_order_relaxed) > 1;
+
+    auto bitrate = current.load(std::memory_order_relaxed);
+    auto target  = bitrate;
+    if(loss_count > 0 || backlog) {
+      last_congestion = now;
+
+      if(now - last_change >= decrease_interval) {
+        target = std::max(min, bitrate * 4 / 5);
+      }
+    }
+    else if(now - last_congestion >= hold && now - last_change >= increase_interval) {
+      target = std::min(max, bitrate + max / 20);
+    }
+
+    if(target == bitrate) {
+      return;
+    }
+
+    BOOST_LOG(debug) << "Bitrate: "sv << target << " kbps"sv;
+
+    current.store(target, std::memory_order_relaxed);
+    last_change = now;
+    bitrate_events->raise(target);
+  }
+};
+
 struct broadcast_ctx_t {
   message_queue_queue_t message_queue_queue;
 
@@ -248,6 +625,41 @@ struct broadcast_ctx_t {
   util::sync_t<std::vector<std::pair<std::string, std::uint16_t>>> audio_video_connections;
 
   control_server_t control_server;
+
+  // Shared by all sessions
+  fec::rs_cache_t rs_cache { 32 };
+
+  video_stats_t video_stats;
+
+  // Use UDP segmentation offload for video
+  std::atomic<bool> video_gso;
+
+  // Encodes the FEC blocks of large frames in parallel
+  fec::pool_t fec_pool;
+
+  // One for each of config::stream.channels
+  std::vector<std::unique_ptr<video_worker_t>> video_workers;
+  std::mutex video_workers_lock;
+
+  /**
+   * Assign a session to the worker with the fewest sessions
+   */
+  video_worker_t *assign_video_worker() {
+    std::lock_guard lg { video_workers_lock };
+
+    auto worker = std::min_element(std::begin(video_workers), std::end(video_workers), [](auto &l, auto &r) {
+      return l->sessions < r->sessions;
+    });
+
+    ++(*worker)->sessions;
+    return worker->get();
+  }
+
+  void release_video_worker(video_worker_t *worker) {
+    std::lock_guard lg { video_workers_lock };
+
+    --worker->sessions;
+  }
 };
 
 struct session_t {
@@ -268,6 +680,19 @@ struct session_t {
     int lowseq;
     udp::endpoint peer;
     safe::mail_raw_t::event_t<bool> idr_events;
+    safe::mail_raw_t::queue_t<std::int64_t> invalidate_ref_frames_events;
+
+    video_pacer_t pacer;
+    fec_controller_t fec_controller;
+    bitrate_controller_t bitrate_controller;
+
+    // Frames dropped because its worker fell behind
+    std::atomic<std::uint64_t> dropped_frames { 0 };
+
+    // Frames handed to the worker, and the end marker of join(), that still point to this session
+    std::atomic<int> queued_frames { 0 };
+
+    video_worker_t *worker;
   } video;
 
   struct {
@@ -283,6 +708,9 @@ struct session_t {
     util::buffer_t<uint8_t *> shards_p;
 
     audio_fec_packet_t fec_packet;
+
+    // Set once the broadcast thread popped the end marker of join()
+    std::atomic<bool> flushed { false };
   } audio;
 
   struct {
@@ -431,8 +859,10 @@ void control_server_t::iterate(std::chrono::milliseconds timeout) {
 }
 
 namespace fec {
-using rs_t = util::safe_ptr<reed_solomon, reed_solomon_release>;
-
+/**
+ * A FEC block, reused between frames by the thread sending them.
+ * Its buffers only grow, so in steady state sending a frame doesn't allocate
+ */
 struct fec_t {
   size_t data_shards;
   size_t nr_shards;
@@ -440,6 +870,23 @@ struct fec_t {
 
   size_t blocksize;
   util::buffer_t<char> shards;
+  util::buffer_t<uint8_t *> shards_p;
+
+  // nullptr if there are no parity shards
+  std::shared_ptr<reed_solomon> rs;
+
+  // The percentage was lowered to stay within DATA_SHARDS_MAX
+  bool reduced;
+
+  // The first header_size bytes of each data shard, as they were before the data shards were sent
+  size_t header_size;
+  util::buffer_t<char> headers;
+
+  // Raised once the parity shards are generated by fec::pool_t
+  safe::signal_t encoded;
+
+  // The number of times a buffer had to grow
+  std::uint64_t allocations = 0;
 
   char *data(size_t el) {
     return &shards[el * blocksize];
@@ -454,12 +901,44 @@ struct fec_t {
   }
 };
 
-static fec_t encode(const std::string_view &payload, size_t blocksize, size_t fecpercentage, size_t minparityshards) {
-  auto payload_size = payload.size();
+/**
+ * Grow buffer to at least elements, without initializing them
+ */
+template<class T>
+static void reserve(fec_t &shards, util::buffer_t<T> &buffer, size_t elements) {
+  if(buffer.size() >= elements) {
+    return;
+  }
+
+  buffer = util::buffer_t<T>::uninitialized(elements);
+  ++shards.allocations;
+}
 
-  auto pad = payload_size % blocksize != 0;
+/**
+ * The largest number of data shards a single FEC block can hold,
+ * such that its parity shards still fit within DATA_SHARDS_MAX
+ */
+static size_t max_data_shards(size_t fecpercentage, size_t minparityshards) {
+  if(minparityshards >= DATA_SHARDS_MAX) {
+    return DATA_SHARDS_MAX;
+  }
 
-  auto data_shards   = payload_size / blocksize + (pad ? 1 : 0);
+  for(auto data_shards = DATA_SHARDS_MAX - minparityshards; data_shards > 1; --data_shards) {
+    auto parity_shards = std::max((data_shards * fecpercentage + 99) / 100, minparityshards);
+
+    if(data_shards + parity_shards <= DATA_SHARDS_MAX) {
+      return data_shards;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Prepare shards for a FEC block of data_shards packets.
+ * The caller writes the data shards in place, fec::encode then generates the parity shards.
+ */
+static void alloc(fec_t &shards, size_t data_shards, size_t blocksize, size_t fecpercentage, size_t minparityshards, rs_cache_t &rs_cache) {
   auto parity_shards = (data_shards * fecpercentage + 99) / 100;
 
   // increase the FEC percentage for this frame if the parity shard minimum is not met
@@ -470,87 +949,183 @@ static fec_t encode(const std::string_view &payload, size_t blocksize, size_t fe
     BOOST_LOG(verbose) << "Increasing FEC percentage to "sv << fecpercentage << " to meet parity shard minimum"sv << std::endl;
   }
 
+  auto reduced   = false;
   auto nr_shards = data_shards + parity_shards;
   if(nr_shards > DATA_SHARDS_MAX) {
-    BOOST_LOG(warning)
-      << "Number of fragments for reed solomon exceeds DATA_SHARDS_MAX"sv << std::endl
-      << nr_shards << " > "sv << DATA_SHARDS_MAX
-      << ", skipping error correction"sv;
+    if(data_shards < DATA_SHARDS_MAX) {
+      // Use as many parity shards as still fit
+      fecpercentage = (100 * (DATA_SHARDS_MAX - data_shards)) / data_shards;
+      nr_shards     = data_shards + (data_shards * fecpercentage + 99) / 100;
+      reduced       = true;
+
+      BOOST_LOG(verbose) << "Decreasing FEC percentage to "sv << fecpercentage << " to stay within DATA_SHARDS_MAX"sv;
+    }
+    else {
+      BOOST_LOG(warning)
+        << "Number of fragments for reed solomon exceeds DATA_SHARDS_MAX"sv << std::endl
+        << nr_shards << " > "sv << DATA_SHARDS_MAX
+        << ", skipping error correction"sv;
+
+      nr_shards     = data_shards;
+      fecpercentage = 0;
+    }
+  }
 
-    nr_shards     = data_shards;
-    fecpercentage = 0;
+  // The encoder is needed up front, the data shards may be sent before the parity shards are generated
+  shards.rs.reset();
+  if(nr_shards > data_shards) {
+    shards.rs = rs_cache.get(data_shards, nr_shards - data_shards);
+    if(!shards.rs) {
+      BOOST_LOG(error) << "Couldn't create reed solomon encoder, skipping error correction"sv;
+
+      nr_shards     = data_shards;
+      fecpercentage = 0;
+    }
   }
 
-  util::buffer_t<char> shards { nr_shards * blocksize };
-  util::buffer_t<uint8_t *> shards_p { nr_shards };
+  shards.data_shards = data_shards;
+  shards.nr_shards   = nr_shards;
+  shards.percentage  = fecpercentage;
+  shards.reduced     = reduced && shards.rs;
+  shards.blocksize   = blocksize;
+  shards.header_size = 0;
 
-  // copy payload + padding
-  auto next = std::copy(std::begin(payload), std::end(payload), std::begin(shards));
-  std::fill(next, std::end(shards), 0); // padding with zero
+  // Large enough for any block of this packet size
+  reserve(shards, shards.shards, std::max<size_t>(DATA_SHARDS_MAX, nr_shards) * blocksize);
+  reserve(shards, shards.shards_p, std::max<size_t>(DATA_SHARDS_MAX, nr_shards));
+}
 
-  for(auto x = 0; x < nr_shards; ++x) {
-    shards_p[x] = (uint8_t *)&shards[x * blocksize];
+/**
+ * Copy the first header_size bytes of each data shard.
+ * Afterwards, the data shards may be modified there and sent before fec::encode is called.
+ */
+static void save_headers(fec_t &shards, size_t header_size) {
+  if(!shards.rs) {
+    return;
   }
 
-  if(data_shards + parity_shards <= DATA_SHARDS_MAX) {
-    // packets = parity_shards + data_shards
-    rs_t rs { reed_solomon_new(data_shards, parity_shards) };
+  shards.header_size = header_size;
+  reserve(shards, shards.headers, std::max<size_t>(DATA_SHARDS_MAX, shards.data_shards) * header_size);
 
-    reed_solomon_encode(rs.get(), shards_p.begin(), nr_shards, blocksize);
+  for(auto x = 0; x < shards.data_shards; ++x) {
+    std::copy_n(shards.data(x), header_size, &shards.headers[x * header_size]);
   }
+}
 
-  return {
-    data_shards,
-    nr_shards,
-    fecpercentage,
-    blocksize,
-    std::move(shards)
-  };
+static void encode(fec_t &shards) {
+  if(!shards.rs) {
+    return;
+  }
+
+  auto &shards_p = shards.shards_p;
+  for(auto x = 0; x < shards.nr_shards; ++x) {
+    shards_p[x] = (uint8_t *)shards.data(x);
+  }
+
+  if(!shards.header_size) {
+    gf256::encode(shards.rs.get(), shards_p.begin(), shards.nr_shards, shards.blocksize);
+
+    return;
+  }
+
+  // Each byte of the parity shards depends only on the bytes at the same offset in the data shards,
+  // so the headers and the rest of the shards are encoded separately
+  for(auto x = 0; x < shards.nr_shards; ++x) {
+    shards_p[x] += shards.header_size;
+  }
+  gf256::encode(shards.rs.get(), shards_p.begin(), shards.nr_shards, shards.blocksize - shards.header_size);
+
+  for(auto x = 0; x < shards.nr_shards; ++x) {
+    shards_p[x] = x < shards.data_shards ?
+                    (uint8_t *)&shards.headers[x * shards.header_size] :
+                    (uint8_t *)shards.data(x);
+  }
+  gf256::encode(shards.rs.get(), shards_p.begin(), shards.nr_shards, shards.header_size);
 }
 } // namespace fec
 
-template<class F>
-std::vector<uint8_t> insert(uint64_t insert_size, uint64_t slice_size, const std::string_view &data, F &&f) {
-  auto pad      = data.size() % slice_size != 0;
-  auto elements = data.size() / slice_size + (pad ? 1 : 0);
-
-  std::vector<uint8_t> result;
-  result.resize(elements * insert_size + data.size());
+/**
+ * The payload of a video frame, as a sequence of views into buffers owned by someone else:
+ * the nvidia packet header, the encoded frame and the replacements for its SPS/VPS headers.
+ *
+ * This allows the packetizer to copy the payload straight into the shards,
+ * without first building a contiguous copy of the frame.
+ */
+class frame_payload_t {
+public:
+  void clear() {
+    _segments.clear();
 
-  auto next = std::begin(data);
-  for(auto x = 0; x < elements - 1; ++x) {
-    void *p = &result[x * (insert_size + slice_size)];
+    _size    = 0;
+    _segment = 0;
+    _offset  = 0;
+  }
 
-    f(p, x, elements);
+  void append(const std::string_view &segment) {
+    if(segment.empty()) {
+      return;
+    }
 
-    std::copy(next, next + slice_size, (char *)p + insert_size);
-    next += slice_size;
+    _segments.emplace_back(segment);
+    _size += segment.size();
   }
 
-  auto x  = elements - 1;
-  void *p = &result[x * (insert_size + slice_size)];
+  /**
+   * Copy the next count bytes of the payload to dest.
+   * returns the number of bytes copied, less than count when the end of the payload is reached
+   */
+  std::size_t read(uint8_t *dest, std::size_t count) {
+    std::size_t bytes = 0;
 
-  f(p, x, elements);
+    while(bytes < count && _segment < _segments.size()) {
+      auto &segment = _segments[_segment];
 
-  std::copy(next, std::end(data), (char *)p + insert_size);
+      auto bytes_segment = std::min(count - bytes, segment.size() - _offset);
+      std::copy_n(segment.data() + _offset, bytes_segment, dest + bytes);
 
-  return result;
-}
+      bytes += bytes_segment;
+      _offset += bytes_segment;
+
+      if(_offset == segment.size()) {
+        ++_segment;
+        _offset = 0;
+      }
+    }
+
+    return bytes;
+  }
+
+  std::size_t size() const {
+    return _size;
+  }
+
+private:
+  std::vector<std::string_view> _segments;
+
+  std::size_t _size    = 0;
+  std::size_t _segment = 0;
+  std::size_t _offset  = 0;
+};
 
-std::vector<uint8_t> replace(const std::string_view &original, const std::string_view &old, const std::string_view &_new) {
-  std::vector<uint8_t> replaced;
+/**
+ * Split the encoded frame into segments, applying the splices without copying the frame.
+ * splices --> sorted by offset
+ */
+static void split_frame(frame_payload_t &payload, const std::string_view &frame, const std::vector<video::packet_raw_t::splice_t> &splices) {
+  std::size_t next = 0;
+  for(auto &splice : splices) {
+    // Overlapping replacements can't both be applied
+    if(splice.offset < next) {
+      continue;
+    }
 
-  auto begin = std::begin(original);
-  auto end   = std::end(original);
-  auto next  = std::search(begin, end, std::begin(old), std::end(old));
+    payload.append(frame.substr(next, splice.offset - next));
+    payload.append(splice._new);
 
-  std::copy(begin, next, std::back_inserter(replaced));
-  if(next != end) {
-    std::copy(std::begin(_new), std::end(_new), std::back_inserter(replaced));
-    std::copy(next + old.size(), end, std::back_inserter(replaced));
+    next = splice.offset + splice.size;
   }
 
-  return replaced;
+  payload.append(frame.substr(next));
 }
 
 int send_rumble(session_t *session, std::uint16_t id, std::uint16_t lowfreq, std::uint16_t highfreq) {
@@ -607,6 +1182,10 @@ void controlBroadcastThread(control_server_t *server) {
 
     auto lastGoodFrame = stats[3];
 
+    auto now = std::chrono::steady_clock::now();
+    session->video.fec_controller.update(count, t, now);
+    session->video.bitrate_controller.update(count, now);
+
     BOOST_LOG(verbose)
       << "type [IDX_LOSS_STATS]"sv << std::endl
       << "---begin stats---" << std::endl
@@ -632,7 +1211,8 @@ void controlBroadcastThread(control_server_t *server) {
       << "firstFrame [" << firstFrame << ']' << std::endl
       << "lastFrame [" << lastFrame << ']';
 
-    session->video.idr_events->raise(true);
+    // The encoder falls back to an IDR frame if it can't invalidate the reference frames
+    session->video.invalidate_ref_frames_events->raise(firstFrame);
   });
 
   server->map(packetTypes[IDX_INPUT_DATA], [&](session_t *session, const std::string_view &payload) {
@@ -883,93 +1463,130 @@ void recvThread(broadcast_ctx_t &ctx) {
   }
 }
 
-void videoBroadcastThread(udp::socket &sock) {
-  auto shutdown_event = mail::man->event<bool>(mail::broadcast_shutdown);
-  auto packets        = mail::man->queue<video::packet_t>(mail::video_packets);
+/**
+ * Settle the frames left in a queue nothing takes them from anymore, join() waits for them
+ * counted --> every frame is counted in queued_frames, otherwise only the end markers of join() are
+ */
+template<class T>
+static void drain_video(T &packets, bool counted) {
+  while(auto packet = packets.try_pop()) {
+    if(counted || !packet->data) {
+      auto session = (session_t *)packet->channel_data;
+      session->video.queued_frames.fetch_sub(1, std::memory_order_release);
+    }
+  }
+}
 
-  while(auto packet = packets->pop()) {
-    if(shutdown_event->peek()) {
-      break;
+/**
+ * Settle the audio packets left in a queue nothing takes them from anymore, join() waits for the end markers
+ */
+template<class T>
+static void drain_audio(T &packets) {
+  while(auto packet = packets.try_pop()) {
+    TUPLE_2D_REF(channel_data, packet_data, *packet);
+
+    if(!packet_data.size()) {
+      ((session_t *)channel_data)->audio.flushed.store(true, std::memory_order_release);
     }
+    else {
+      audio::free_packet(std::move(packet_data));
+    }
+  }
+}
 
-    auto session = (session_t *)packet->channel_data;
-    auto lowseq  = session->video.lowseq;
+void videoSendThread(broadcast_ctx_t &ctx, video_worker_t &worker) {
+  auto &sock = ctx.video_sock;
 
-    std::string_view payload { (char *)packet->data, (size_t)packet->size };
-    std::vector<uint8_t> payload_new;
+  auto shutdown_event = mail::man->event<bool>(mail::broadcast_shutdown);
 
-    auto nv_packet_header = "\0017charss"sv;
-    std::copy(std::begin(nv_packet_header), std::end(nv_packet_header), std::back_inserter(payload_new));
-    std::copy(std::begin(payload), std::end(payload), std::back_inserter(payload_new));
+  // Moonlight accepts up to 4 FEC blocks per frame
+  constexpr auto MAX_FEC_BLOCKS = 4;
 
-    payload = { (char *)payload_new.data(), payload_new.size() };
+  // Reused between frames to avoid reallocating the list of segments and the shards
+  frame_payload_t payload;
+  std::array<fec::fec_t, MAX_FEC_BLOCKS> blocks;
 
-    if(packet->flags & AV_PKT_FLAG_KEY) {
-      for(auto &replacement : *packet->replacements) {
-        auto frame_old = replacement.old;
-        auto frame_new = replacement._new;
+  auto fg = util::fail_guard([&worker]() {
+    worker.packets.stop();
+    drain_video(worker.packets, true);
+  });
 
-        payload_new = replace(payload, frame_old, frame_new);
-        payload     = { (char *)payload_new.data(), payload_new.size() };
-      }
+  while(auto packet = worker.packets.pop()) {
+    auto session = (session_t *)packet->channel_data;
+    if(shutdown_event->peek()) {
+      session->video.queued_frames.fetch_sub(1, std::memory_order_release);
+
+      break;
     }
 
-    // insert packet headers
+    auto lowseq = session->video.lowseq;
+
+    std::string_view frame { (char *)packet->data, (size_t)packet->size };
+
+    payload.clear();
+    payload.append("\0017charss"sv);
+    split_frame(payload, frame, packet->splices);
+
+    // Every packet starts with a video_packet_raw_t, followed by up to payload_blocksize bytes of the frame
     auto blocksize         = session->config.packetsize + MAX_RTP_HEADER_SIZE;
     auto payload_blocksize = blocksize - sizeof(video_packet_raw_t);
 
-    auto fecPercentage = config::stream.fec_percentage;
+    auto nr_packets = (payload.size() + (payload_blocksize - 1)) / payload_blocksize;
 
-    payload_new = insert(sizeof(video_packet_raw_t), payload_blocksize,
-      payload, [&](void *p, int fecIndex, int end) {
-        video_packet_raw_t *video_packet = (video_packet_raw_t *)p;
+    // The size of the frame, including the video packet headers
+    auto payload_size = payload.size() + nr_packets * sizeof(video_packet_raw_t);
 
-        video_packet->packet.flags = FLAG_CONTAINS_PIC_DATA;
-      });
+    auto fecPercentage = session->video.fec_controller.percentage.load(std::memory_order_relaxed);
 
-    payload = std::string_view { (char *)payload_new.data(), payload_new.size() };
+    auto &pacer = session->video.pacer;
+    if(pacer.enabled()) {
+      // Estimate the parity shards up front, the exact number is only known per FEC block
+      auto frame_bytes = nr_packets * blocksize * (100 + fecPercentage) / 100;
 
-    // With a fecpercentage of 255, if payload_new is broken up into more than a 100 data_shards
-    // it will generate greater than DATA_SHARDS_MAX shards.
-    // Therefore, we start breaking the data up into three seperate fec blocks.
+      // Follow the bitrate the encoder was last asked for, not the one the session started with
+      auto bitrate = session->video.bitrate_controller.current.load(std::memory_order_relaxed);
+
+      pacer.start_frame(frame_bytes, session->config.monitor.framerate, bitrate, blocksize);
+    }
+
+    // Large frames are split into at least 3 blocks, so their parity shards are generated in parallel
     auto multi_fec_threshold = 90 * blocksize;
 
-    // We can go up to 4 fec blocks, but 3 is plenty
-    constexpr auto MAX_FEC_BLOCKS = 3;
+    // Each block must hold its parity shards within DATA_SHARDS_MAX
+    auto max_packets   = fec::max_data_shards(fecPercentage, session->config.minRequiredFecPackets);
+    auto nr_fec_blocks = (int)std::clamp<std::size_t>((nr_packets + max_packets - 1) / max_packets, 1, MAX_FEC_BLOCKS);
+    if(payload_size > multi_fec_threshold) {
+      nr_fec_blocks = std::max(nr_fec_blocks, 3);
+    }
 
-    std::array<std::string_view, MAX_FEC_BLOCKS> fec_blocks;
-    decltype(fec_blocks)::iterator
-      fec_blocks_begin = std::begin(fec_blocks),
-      fec_blocks_end   = std::begin(fec_blocks) + 1;
+    // The number of packets in each fec block, each containing multiple complete video packets
+    std::array<std::size_t, MAX_FEC_BLOCKS> fec_blocks;
+    for(auto x = 0; x < nr_fec_blocks; ++x) {
+      fec_blocks[x] = nr_packets / nr_fec_blocks + (x < nr_packets % nr_fec_blocks ? 1 : 0);
+    }
 
-    auto lastBlockIndex = 0;
-    if(payload.size() > multi_fec_threshold) {
-      BOOST_LOG(verbose) << "Generating multiple FEC blocks"sv;
+    auto lastBlockIndex = (nr_fec_blocks - 1) << 6;
 
-      // Align individual fec blocks to blocksize
-      auto unaligned_size = payload.size() / MAX_FEC_BLOCKS;
-      auto aligned_size   = ((unaligned_size + (blocksize - 1)) / blocksize) * blocksize;
+    BOOST_LOG(verbose) << "Generating ["sv << nr_fec_blocks << "] FEC blocks"sv;
 
-      // Break the data up into 3 blocks, each containing multiple complete video packets.
-      fec_blocks[0] = payload.substr(0, aligned_size);
-      fec_blocks[1] = payload.substr(aligned_size, aligned_size);
-      fec_blocks[2] = payload.substr(aligned_size * 2);
+    std::array<int, MAX_FEC_BLOCKS> blocks_lowseq;
 
-      lastBlockIndex = 2 << 6;
-      fec_blocks_end = std::end(fec_blocks);
-    }
-    else {
-      BOOST_LOG(verbose) << "Generating single FEC block"sv;
-      fec_blocks[0] = payload;
-    }
+    // The slices of the frame are read sequentially, so the data shards of all blocks are written first
+    for(auto blockIndex = 0; blockIndex < nr_fec_blocks; ++blockIndex) {
+      auto packets = fec_blocks[blockIndex];
+
+      auto &shards = blocks[blockIndex];
+      fec::alloc(shards, packets, blocksize, fecPercentage, session->config.minRequiredFecPackets, ctx.rs_cache);
 
-    auto blockIndex = 0;
-    std::for_each(fec_blocks_begin, fec_blocks_end, [&](std::string_view &current_payload) {
-      auto packets = (current_payload.size() + (blocksize - 1)) / blocksize;
+      blocks_lowseq[blockIndex] = lowseq;
 
+      // Write the data shards in place: header first, then the next slice of the frame
       for(int x = 0; x < packets; ++x) {
-        auto *inspect = (video_packet_raw_t *)&current_payload[x * blocksize];
+        auto *inspect = (video_packet_raw_t *)shards.data(x);
+
+        std::memset(inspect, 0, sizeof(video_packet_raw_t));
 
+        inspect->packet.flags             = FLAG_CONTAINS_PIC_DATA;
         inspect->packet.frameIndex        = packet->pts;
         inspect->packet.streamPacketIndex = ((uint32_t)lowseq + x) << 8;
 
@@ -984,42 +1601,218 @@ void videoBroadcastThread(udp::socket &sock) {
         if(x == packets - 1) {
           inspect->packet.flags |= FLAG_EOF;
         }
+
+        // padding with zero
+        auto bytes = payload.read(inspect->payload(), payload_blocksize);
+        std::fill_n(inspect->payload() + bytes, payload_blocksize - bytes, 0);
       }
 
-      auto shards = fec::encode(current_payload, blocksize, fecPercentage, session->config.minRequiredFecPackets);
+      lowseq += shards.size();
+    }
 
-      // set FEC info now that we know for sure what our percentage will be for this frame
-      for(auto x = 0; x < shards.size(); ++x) {
-        auto *inspect = (video_packet_raw_t *)shards.data(x);
+    auto wants_fec = fecPercentage > 0 || session->config.minRequiredFecPackets > 0;
+    if(wants_fec && std::any_of(std::begin(blocks), std::begin(blocks) + nr_fec_blocks, [](auto &shards) { return !shards.rs; })) {
+      ++ctx.video_stats.frames_without_fec;
+    }
+    else if(std::any_of(std::begin(blocks), std::begin(blocks) + nr_fec_blocks, [](auto &shards) { return shards.reduced; })) {
+      ++ctx.video_stats.frames_with_reduced_fec;
+
+      if(!ctx.video_stats.warned_reduced_fec.exchange(true, std::memory_order_relaxed)) {
+        BOOST_LOG(warning) << "Video: frame ["sv << packet->pts << "] is too large for "sv << fecPercentage << "% error correction, large frames get less"sv;
+      }
+    }
 
-        inspect->packet.fecInfo =
-          (x << 12 |
-            shards.data_shards << 22 |
-            shards.percentage << 4);
+    // The fields only known for sure once the FEC block is allocated
+    auto finalize_shard = [&](fec::fec_t &shards, int blockIndex, int x) {
+      auto *inspect = (video_packet_raw_t *)shards.data(x);
 
-        inspect->rtp.header         = 0x80 | FLAG_EXTENSION;
-        inspect->rtp.sequenceNumber = util::endian::big<uint16_t>(lowseq + x);
+      inspect->packet.fecInfo =
+        (x << 12 |
+          shards.data_shards << 22 |
+          shards.percentage << 4);
 
-        inspect->packet.multiFecBlocks = (blockIndex << 4) | lastBlockIndex;
-        inspect->packet.frameIndex     = packet->pts;
+      inspect->rtp.header         = 0x80 | FLAG_EXTENSION;
+      inspect->rtp.sequenceNumber = util::endian::big<uint16_t>(blocks_lowseq[blockIndex] + x);
+
+      inspect->packet.multiFecBlocks = (blockIndex << 4) | lastBlockIndex;
+      inspect->packet.frameIndex     = packet->pts;
+    };
+
+    // Send the shards [begin, end) of a block
+    auto send_shards = [&](fec::fec_t &shards, std::size_t begin, std::size_t end) {
+      // Without pacing, all shards are sent at once
+      auto burst = pacer.enabled() ? video_pacer_t::burst_packets : end - begin;
+      for(auto x = begin; x < end; x += burst) {
+        auto count = std::min(burst, end - x);
+
+        if(pacer.enabled()) {
+          pacer.wait(count * shards.blocksize);
+        }
+
+        platf::batched_send_info_t send_info {
+          shards.data(x),
+          shards.blocksize,
+          count,
+          (std::uintptr_t)sock.native_handle(),
+          session->video.peer.data(),
+          session->video.peer.size(),
+          ctx.video_gso.load(std::memory_order_relaxed),
+        };
+
+        auto send_begin = std::chrono::steady_clock::now();
+        auto syscalls   = platf::send_batch(send_info);
+        auto send_end   = std::chrono::steady_clock::now();
+
+        // The network interface doesn't support it after all
+        if(!send_info.segmentation_offload) {
+          ctx.video_gso.store(false, std::memory_order_relaxed);
+        }
+
+        if(syscalls < 0) {
+          BOOST_LOG(warning) << "Couldn't send video frame ["sv << packet->pts << ']';
+          return;
+        }
+
+        ctx.video_stats.packets += count;
+        ctx.video_stats.syscalls += syscalls;
+        ctx.video_stats.syscall_time += std::chrono::nanoseconds { send_end - send_begin }.count();
+      }
+    };
+
+    // The data shards are sent while the parity shards are generated.
+    // Parity covers the headers as they were before finalizing, so those are saved first
+    for(auto blockIndex = 0; blockIndex < nr_fec_blocks; ++blockIndex) {
+      auto &shards = blocks[blockIndex];
+
+      fec::save_headers(shards, sizeof(video_packet_raw_t));
+
+      for(auto x = 0; x < shards.data_shards; ++x) {
+        finalize_shard(shards, blockIndex, x);
+      }
+    }
+
+    // The blocks share no state, the pool generates their parity shards in parallel
+    std::array<bool, MAX_FEC_BLOCKS> pooled {};
+    if(!ctx.fec_pool.empty()) {
+      for(auto blockIndex = 0; blockIndex < nr_fec_blocks; ++blockIndex) {
+        auto &shards = blocks[blockIndex];
+        if(!shards.rs) {
+          continue;
+        }
+
+        ctx.fec_pool.push(fec::pool_t::task_t { [&shards]() {
+          fec::encode(shards);
+          shards.encoded.raise(true);
+        } });
+        pooled[blockIndex] = true;
+      }
+    }
+
+    // Send the blocks in order, each with its data shards first
+    for(auto blockIndex = 0; blockIndex < nr_fec_blocks; ++blockIndex) {
+      auto &shards = blocks[blockIndex];
+
+      send_shards(shards, 0, shards.data_shards);
+
+      if(pooled[blockIndex]) {
+        shards.encoded.pop();
+      }
+      else {
+        fec::encode(shards);
       }
 
-      for(auto x = 0; x < shards.size(); ++x) {
-        sock.send_to(asio::buffer(shards[x]), session->video.peer);
+      for(auto x = shards.data_shards; x < shards.size(); ++x) {
+        finalize_shard(shards, blockIndex, x);
       }
 
+      send_shards(shards, shards.data_shards, shards.size());
+
       if(packet->flags & AV_PKT_FLAG_KEY) {
         BOOST_LOG(verbose) << "Key Frame ["sv << packet->pts << "] :: send ["sv << shards.size() << "] shards..."sv;
       }
       else {
         BOOST_LOG(verbose) << "Frame ["sv << packet->pts << "] :: send ["sv << shards.size() << "] shards..."sv << std::endl;
       }
+    }
 
-      ++blockIndex;
-      lowseq += shards.size();
-    });
+    for(auto &shards : blocks) {
+      ctx.video_stats.allocations += std::exchange(shards.allocations, 0);
+    }
 
     session->video.lowseq = lowseq;
+    session->video.bitrate_controller.sent_pts.store(packet->pts, std::memory_order_relaxed);
+
+    // From here on, join() may destroy the session
+    session->video.queued_frames.fetch_sub(1, std::memory_order_release);
+
+    ctx.video_stats.report(std::chrono::steady_clock::now());
+  }
+}
+
+/**
+ * Hands each frame to the worker of its session,
+ * so a large frame of one session doesn't delay the frames of the others
+ */
+void videoBroadcastThread(broadcast_ctx_t &ctx) {
+  auto shutdown_event = mail::man->event<bool>(mail::broadcast_shutdown);
+  auto packets        = mail::man->ring<video::packet_t>(mail::video_packets);
+
+  auto fg = util::fail_guard([&packets]() {
+    packets->stop();
+    drain_video(*packets, false);
+  });
+
+  while(auto packet = packets->pop()) {
+    auto session = (session_t *)packet->channel_data;
+
+    // The end marker of join(), every frame of the session before it has been handed to the worker
+    if(!packet->data) {
+      session->video.queued_frames.fetch_sub(1, std::memory_order_release);
+
+      continue;
+    }
+
+    if(shutdown_event->peek()) {
+      break;
+    }
+
+    session->video.bitrate_controller.queued_pts.store(packet->pts, std::memory_order_relaxed);
+    session->video.queued_frames.fetch_add(1, std::memory_order_relaxed);
+
+    // If the worker falls behind, old frames are dropped rather than the keyframe the client waits for
+    // key --> a keyframe of this session got queued
+    bool key = packet->flags & AV_PKT_FLAG_KEY;
+
+    video::packet_t dropped;
+    if(config::stream.drop_oldest) {
+      dropped = session->video.worker->packets.raise_drop_oldest(std::move(packet), key);
+    }
+    else {
+      session->video.worker->packets.raise(std::move(packet));
+    }
+
+    // The frame itself wasn't queued, the queue is full or the worker has stopped
+    if(packet) {
+      dropped = std::move(packet);
+      key     = false;
+    }
+
+    if(!dropped) {
+      continue;
+    }
+
+    auto dropped_session = (session_t *)dropped->channel_data;
+    dropped_session->video.dropped_frames.fetch_add(1, std::memory_order_relaxed);
+
+    BOOST_LOG(debug) << "Video: worker fell behind, dropped frame ["sv << dropped->pts << ']';
+
+    // Every frame is a reference frame, so the client can't decode the frames after it.
+    // Unless a keyframe of that session was just queued
+    if(!key || dropped_session != session) {
+      dropped_session->video.idr_events->raise(true);
+    }
+
+    dropped_session->video.queued_frames.fetch_sub(1, std::memory_order_release);
   }
 
   shutdown_event->raise(true);
@@ -1027,7 +1820,7 @@ void videoBroadcastThread(udp::socket &sock) {
 
 void audioBroadcastThread(udp::socket &sock) {
   auto shutdown_event = mail::man->event<bool>(mail::broadcast_shutdown);
-  auto packets        = mail::man->queue<audio::packet_t>(mail::audio_packets);
+  auto packets        = mail::man->ring<audio::packet_t>(mail::audio_packets);
 
   constexpr auto max_block_size = crypto::cipher::round_to_pkcs7_padded(2048);
 
@@ -1047,14 +1840,26 @@ void audioBroadcastThread(udp::socket &sock) {
   audio_packet->rtp.packetType = 97;
   audio_packet->rtp.ssrc       = 0;
 
+  auto fg = util::fail_guard([&packets]() {
+    packets->stop();
+    drain_audio(*packets);
+  });
+
   while(auto packet = packets->pop()) {
+    TUPLE_2D_REF(channel_data, packet_data, *packet);
+    auto session = (session_t *)channel_data;
+
+    // The end marker of join(), no packet of the session is left in the queue
+    if(!packet_data.size()) {
+      session->audio.flushed.store(true, std::memory_order_release);
+
+      continue;
+    }
+
     if(shutdown_event->peek()) {
       break;
     }
 
-    TUPLE_2D_REF(channel_data, packet_data, *packet);
-    auto session = (session_t *)channel_data;
-
     auto sequenceNumber = session->audio.sequenceNumber;
     auto timestamp      = session->audio.timestamp;
 
@@ -1068,6 +1873,9 @@ void audioBroadcastThread(udp::socket &sock) {
       break;
     }
 
+    // encode_audio copied it into audio_packet
+    audio::free_packet(std::move(packet_data));
+
     audio_packet->rtp.sequenceNumber = util::endian::big(sequenceNumber);
     audio_packet->rtp.timestamp      = util::endian::big(timestamp);
 
@@ -1091,7 +1899,7 @@ void audioBroadcastThread(udp::socket &sock) {
 
     // generate parity shards at the end of the FEC block
     if((sequenceNumber + 1) % RTPA_DATA_SHARDS == 0) {
-      reed_solomon_encode(rs.get(), shards_p.begin(), RTPA_TOTAL_SHARDS, bytes);
+      gf256::encode(rs.get(), shards_p.begin(), RTPA_TOTAL_SHARDS, bytes);
 
       for(auto x = 0; x < RTPA_FEC_SHARDS; ++x) {
         fec_packet->rtp.sequenceNumber      = util::endian::big<std::uint16_t>(sequenceNumber + x + 1);
@@ -1132,6 +1940,18 @@ int start_broadcast(broadcast_ctx_t &ctx) {
     return -1;
   }
 
+  ctx.video_gso = false;
+  if(config::stream.udp_gso) {
+    if(platf::udp_segmentation_supported(ctx.video_sock.native_handle())) {
+      BOOST_LOG(info) << "Using UDP segmentation offload for video"sv;
+
+      ctx.video_gso = true;
+    }
+    else {
+      BOOST_LOG(warning) << "UDP segmentation offload is not supported, sending video packets separately"sv;
+    }
+  }
+
   ctx.audio_sock.open(udp::v4(), ec);
   if(ec) {
     BOOST_LOG(fatal) << "Couldn't open socket for Audio server: "sv << ec.message();
@@ -1148,7 +1968,19 @@ int start_broadcast(broadcast_ctx_t &ctx) {
 
   ctx.message_queue_queue = std::make_shared<message_queue_queue_t::element_type>(30);
 
-  ctx.video_thread   = std::thread { videoBroadcastThread, std::ref(ctx.video_sock) };
+  // Each video worker waits for the blocks of at most one frame, no more than 4 blocks per frame
+  ctx.fec_pool.start(config::stream.fec_threads, config::stream.channels * 4);
+
+  ctx.video_workers.clear();
+  for(auto x = 0; x < config::stream.channels; ++x) {
+    auto worker      = std::make_unique<video_worker_t>();
+    worker->sessions = 0;
+    worker->thread   = std::thread { videoSendThread, std::ref(ctx), std::ref(*worker) };
+
+    ctx.video_workers.emplace_back(std::move(worker));
+  }
+
+  ctx.video_thread   = std::thread { videoBroadcastThread, std::ref(ctx) };
   ctx.audio_thread   = std::thread { audioBroadcastThread, std::ref(ctx.audio_sock) };
   ctx.control_thread = std::thread { controlBroadcastThread, &ctx.control_server };
 
@@ -1162,13 +1994,17 @@ void end_broadcast(broadcast_ctx_t &ctx) {
 
   broadcast_shutdown_event->raise(true);
 
-  auto video_packets = mail::man->queue<video::packet_t>(mail::video_packets);
-  auto audio_packets = mail::man->queue<audio::packet_t>(mail::audio_packets);
+  auto video_packets = mail::man->ring<video::packet_t>(mail::video_packets);
+  auto audio_packets = mail::man->ring<audio::packet_t>(mail::audio_packets);
 
   // Minimize delay stopping video/audio threads
   video_packets->stop();
   audio_packets->stop();
 
+  for(auto &worker : ctx.video_workers) {
+    worker->packets.stop();
+  }
+
   ctx.message_queue_queue->stop();
   ctx.io.stop();
 
@@ -1182,12 +2018,21 @@ void end_broadcast(broadcast_ctx_t &ctx) {
   ctx.recv_thread.join();
   BOOST_LOG(debug) << "Waiting for main video thread to end..."sv;
   ctx.video_thread.join();
+  BOOST_LOG(debug) << "Waiting for video workers to end..."sv;
+  for(auto &worker : ctx.video_workers) {
+    worker->thread.join();
+  }
+  ctx.video_workers.clear();
+  BOOST_LOG(debug) << "Waiting for FEC threads to end..."sv;
+  ctx.fec_pool.stop();
   BOOST_LOG(debug) << "Waiting for main audio thread to end..."sv;
   ctx.audio_thread.join();
   BOOST_LOG(debug) << "Waiting for main control thread to end..."sv;
   ctx.control_thread.join();
   BOOST_LOG(debug) << "All broadcasting threads ended"sv;
 
+  BOOST_LOG(debug) << "Reed-Solomon cache: hits ["sv << ctx.rs_cache.hits() << "] misses ["sv << ctx.rs_cache.misses() << ']';
+
   broadcast_shutdown_event->reset();
 }
 
@@ -1310,6 +2155,68 @@ void stop(session_t &session) {
   session.shutdown_event->raise(true);
 }
 
+/**
+ * Wait until no thread handles a frame of the session anymore.
+ * The encoder has stopped, so an end marker queued behind its last frame reaches the broadcast thread after every other frame
+ */
+static void flush_video(session_t &session) {
+  auto packets = mail::man->ring<video::packet_t>(mail::video_packets);
+
+  auto marker  = std::make_unique<video::packet_t::element_type>(&session);
+  marker->data = nullptr;
+  marker->size = 0;
+
+  session.video.queued_frames.fetch_add(1, std::memory_order_relaxed);
+  while(!packets->raise(std::move(marker))) {
+    // Nothing takes the marker anymore, the worker may still be sending a frame of the session
+    if(!packets->running()) {
+      session.video.queued_frames.fetch_sub(1, std::memory_order_relaxed);
+
+      break;
+    }
+
+    std::this_thread::sleep_for(1ms);
+  }
+
+  auto &worker_packets = session.video.worker->packets;
+  while(session.video.queued_frames.load(std::memory_order_acquire)) {
+    // The threads exiting drain their queues, but may miss a frame queued while they stopped
+    if(!packets->running()) {
+      drain_video(*packets, false);
+    }
+
+    if(!worker_packets.running()) {
+      drain_video(worker_packets, true);
+    }
+
+    std::this_thread::sleep_for(1ms);
+  }
+}
+
+/**
+ * Wait until the broadcast thread popped every audio packet of the session
+ */
+static void flush_audio(session_t &session) {
+  auto packets = mail::man->ring<audio::packet_t>(mail::audio_packets);
+
+  while(!packets->raise(&session, audio::buffer_t {})) {
+    if(!packets->running()) {
+      return;
+    }
+
+    std::this_thread::sleep_for(1ms);
+  }
+
+  while(!session.audio.flushed.load(std::memory_order_acquire)) {
+    // The thread exiting drains the queue, but may miss the marker queued while it stopped
+    if(!packets->running()) {
+      drain_audio(*packets);
+    }
+
+    std::this_thread::sleep_for(1ms);
+  }
+}
+
 void join(session_t &session) {
   BOOST_LOG(debug) << "Waiting for video to end..."sv;
   session.videoThread.join();
@@ -1321,6 +2228,17 @@ void join(session_t &session) {
   BOOST_LOG(debug) << "Resetting Input..."sv;
   input::reset(session.input);
 
+  // The threads handling the packets still in the queues point to the session
+  BOOST_LOG(debug) << "Flushing the media queues..."sv;
+  flush_video(session);
+  flush_audio(session);
+
+  session.broadcast_ref->release_video_worker(session.video.worker);
+
+  if(auto dropped_frames = session.video.dropped_frames.load(std::memory_order_relaxed)) {
+    BOOST_LOG(info) << "Video: dropped ["sv << dropped_frames << "] frames the network couldn't keep up with"sv;
+  }
+
   BOOST_LOG(debug) << "Removing references to any connections..."sv;
   {
     auto video_addr = session.video.peer.address().to_string();
@@ -1369,6 +2287,8 @@ int start(session_t &session, const std::string &addr_string) {
 
   session.broadcast_ref->control_server.emplace_addr_to_session(addr_string, session);
 
+  session.video.worker = session.broadcast_ref->assign_video_worker();
+
   auto addr = boost::asio::ip::make_address(addr_string);
   session.video.peer.address(addr);
   session.video.peer.port(0);
@@ -1412,8 +2332,33 @@ std::shared_ptr<session_t> alloc(config_t &config, crypto::aes_t &gcm_key, crypt
     gcm_key, false
   };
 
-  session->video.idr_events = mail->event<bool>(mail::idr);
-  session->video.lowseq     = 0;
+  session->video.idr_events                   = mail->event<bool>(mail::idr);
+  session->video.invalidate_ref_frames_events = mail->queue<std::int64_t>(mail::invalidate_ref_frames);
+  session->video.lowseq                       = 0;
+  session->video.worker                       = nullptr;
+
+  auto &fec_controller     = session->video.fec_controller;
+  fec_controller.min       = config::stream.min_fec_percentage;
+  fec_controller.max       = config::stream.max_fec_percentage;
+  fec_controller.current   = config::stream.fec_percentage;
+  fec_controller.last_loss = std::chrono::steady_clock::now();
+  fec_controller.percentage.store(config::stream.fec_percentage, std::memory_order_relaxed);
+
+  auto &bitrate_controller           = session->video.bitrate_controller;
+  bitrate_controller.max             = config.monitor.bitrate;
+  bitrate_controller.min             = config.monitor.bitrate * config::stream.min_bitrate_percentage / 100;
+  bitrate_controller.current         = config.monitor.bitrate;
+  bitrate_controller.last_change     = std::chrono::steady_clock::now();
+  bitrate_controller.last_congestion = bitrate_controller.last_change;
+  bitrate_controller.queued_pts      = 0;
+  bitrate_controller.sent_pts        = 0;
+  bitrate_controller.bitrate_events  = mail->event<int>(mail::bitrate);
+
+  bitrate_controller.bitrate_fixed_events = mail->event<bool>(mail::bitrate_fixed);
+
+  session->video.pacer.percentage  = config.pacing;
+  session->video.pacer.tokens      = 0;
+  session->video.pacer.last_refill = std::chrono::steady_clock::now();
 
   constexpr auto max_block_size = crypto::cipher::round_to_pkcs7_padded(2048);
 
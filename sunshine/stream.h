@@ -26,6 +26,9 @@ struct config_t {
   int featureFlags;
   int controlProtocolType;
 
+  // Percentage of the frame interval the packets of a frame are spread over, 0 disables pacing
+  int pacing;
+
   std::optional<int> gcmap;
 };
 
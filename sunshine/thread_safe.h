@@ -9,6 +9,7 @@
 #include <condition_variable>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <vector>
 
@@ -311,6 +312,304 @@ private:
   std::vector<T> _queue;
 };
 
+/**
+ * Bounded lock-free ring with a single consumer, for the media hot paths.
+ *
+ * Each slot carries a sequence number telling whether it's ready to be written or read,
+ * so producers and the consumer only touch the slot they claimed.
+ * The consumer only blocks when the ring is empty, producers then take the lock to wake it.
+ *
+ * single_producer --> the producer claims slots without compare-and-swap,
+ *                     and may drop the oldest element when the ring is full
+ */
+template<class T, bool single_producer = false>
+class ring_t {
+public:
+  using status_t = util::optional_t<T>;
+
+  /**
+   * max_elements is rounded up to a power of two
+   */
+  ring_t(std::uint32_t max_elements = 32) {
+    std::size_t capacity = 2;
+    while(capacity < max_elements) {
+      capacity *= 2;
+    }
+
+    _mask  = capacity - 1;
+    _slots = std::make_unique<slot_t[]>(capacity);
+    for(std::size_t x = 0; x < capacity; ++x) {
+      _slots[x].seq.store(x, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * If the ring is full, the element is dropped
+   * returns false if the element is dropped
+   */
+  template<class... Args>
+  bool raise(Args &&...args) {
+    if(!_continue.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    std::size_t pos;
+    auto slot = claim(pos);
+    if(!slot) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+
+      return false;
+    }
+
+    slot->value = T(std::forward<Args>(args)...);
+    publish(*slot, pos);
+
+    return true;
+  }
+
+  /**
+   * If the ring is full, the oldest element is dropped to make room.
+   * The newest pinned element is never dropped, if it's the oldest then element itself is dropped instead.
+   * returns the dropped element, if any
+   */
+  status_t raise_drop_oldest(T &&element, bool pin) {
+    static_assert(single_producer, "Only the producer knows which element is pinned");
+
+    if(!_continue.load(std::memory_order_relaxed)) {
+      return util::false_v<status_t>;
+    }
+
+    status_t dropped = util::false_v<status_t>;
+
+    std::size_t pos;
+    auto slot = claim(pos);
+    while(!slot) {
+      auto head = _head.load(std::memory_order_acquire);
+
+      if(head == _pinned && !pin) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+
+        return std::move(element);
+      }
+
+      // If the consumer took it first, there's room now
+      T oldest;
+      if(take(oldest, head)) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+
+        dropped = std::move(oldest);
+      }
+
+      slot = claim(pos);
+    }
+
+    if(pin) {
+      _pinned = pos;
+    }
+
+    slot->value = std::move(element);
+    publish(*slot, pos);
+
+    return dropped;
+  }
+
+  bool peek() {
+    return _continue.load(std::memory_order_relaxed) && ready();
+  }
+
+  status_t pop() {
+    return pop(std::chrono::steady_clock::time_point::max());
+  }
+
+  template<class Rep, class Period>
+  status_t pop(std::chrono::duration<Rep, Period> delay) {
+    return pop(std::chrono::steady_clock::now() + delay);
+  }
+
+  status_t pop(std::chrono::steady_clock::time_point deadline) {
+    while(_continue.load(std::memory_order_acquire)) {
+      T val;
+      if(take(val, _head.load(std::memory_order_relaxed))) {
+        return val;
+      }
+
+      // The producer dropped the oldest element
+      if(ready()) {
+        continue;
+      }
+
+      if(!spin() && !wait(deadline)) {
+        break;
+      }
+    }
+
+    return util::false_v<status_t>;
+  }
+
+  /**
+   * Take the oldest element without blocking, even if the ring is stopped.
+   * Another thread may take elements concurrently, each element is only taken once
+   */
+  status_t try_pop() {
+    while(ready()) {
+      T val;
+      if(take(val, _head.load(std::memory_order_relaxed))) {
+        return val;
+      }
+    }
+
+    return util::false_v<status_t>;
+  }
+
+  void stop() {
+    std::lock_guard lg { _lock };
+
+    _continue.store(false, std::memory_order_release);
+
+    _cv.notify_all();
+  }
+
+  [[nodiscard]] bool running() const {
+    return _continue.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * returns the number of elements dropped since the last call
+   */
+  std::uint64_t dropped() {
+    return _dropped.exchange(0, std::memory_order_relaxed);
+  }
+
+private:
+  struct slot_t {
+    std::atomic<std::size_t> seq;
+    T value;
+  };
+
+  /**
+   * Claim the slot for the next element
+   * returns nullptr if the ring is full
+   */
+  slot_t *claim(std::size_t &pos) {
+    pos = _tail.load(std::memory_order_relaxed);
+    while(true) {
+      auto slot = &_slots[pos & _mask];
+
+      auto diff = (std::intptr_t)slot->seq.load(std::memory_order_acquire) - (std::intptr_t)pos;
+      if(diff < 0) {
+        return nullptr;
+      }
+
+      if(diff > 0) {
+        pos = _tail.load(std::memory_order_relaxed);
+      }
+      else if constexpr(single_producer) {
+        _tail.store(pos + 1, std::memory_order_relaxed);
+        return slot;
+      }
+      else if(_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        return slot;
+      }
+    }
+  }
+
+  void publish(slot_t &slot, std::size_t pos) {
+    slot.seq.store(pos + 1, std::memory_order_release);
+
+    // Pairs with the fence in wait(), either the consumer sees the element or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(_sleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard lg { _lock };
+      _cv.notify_one();
+    }
+  }
+
+  /**
+   * Take the element at pos, if it's the oldest element.
+   * The producer may take the oldest element too, to drop it
+   */
+  bool take(T &val, std::size_t pos) {
+    auto &slot = _slots[pos & _mask];
+    if(slot.seq.load(std::memory_order_acquire) != pos + 1 ||
+       !_head.compare_exchange_strong(pos, pos + 1, std::memory_order_acquire)) {
+      return false;
+    }
+
+    val = std::move(slot.value);
+    slot.seq.store(pos + _mask + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  bool ready() const {
+    auto head = _head.load(std::memory_order_relaxed);
+
+    return _slots[head & _mask].seq.load(std::memory_order_acquire) == head + 1;
+  }
+
+  /**
+   * Elements often follow each other closely, like the packets of an audio frame.
+   * Polling a little while avoids putting the consumer to sleep for those
+   * returns true if an element is ready
+   */
+  bool spin() const {
+    for(auto x = 0; x < spin_count; ++x) {
+      if(ready()) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Block until an element is raised, the ring is stopped or deadline is reached
+   * returns false on timeout
+   */
+  bool wait(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock ul { _lock };
+
+    _sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    auto status = std::cv_status::no_timeout;
+    while(!ready() && _continue.load(std::memory_order_relaxed) && status == std::cv_status::no_timeout) {
+      if(deadline == std::chrono::steady_clock::time_point::max()) {
+        _cv.wait(ul);
+      }
+      else {
+        status = _cv.wait_until(ul, deadline);
+      }
+    }
+
+    _sleeping.store(false, std::memory_order_relaxed);
+
+    return status == std::cv_status::no_timeout || ready();
+  }
+
+  static constexpr auto spin_count = 4096;
+
+  std::size_t _mask;
+  std::unique_ptr<slot_t[]> _slots;
+
+  // Producers and the consumer each get their own cache line
+  alignas(64) std::atomic<std::size_t> _tail { 0 };
+  alignas(64) std::atomic<std::size_t> _head { 0 };
+
+  // The position of the newest pinned element, only used by the producer
+  std::size_t _pinned { (std::size_t)-1 };
+
+  std::atomic<bool> _sleeping { false };
+  std::atomic<bool> _continue { true };
+  std::atomic<std::uint64_t> _dropped { 0 };
+
+  std::mutex _lock;
+  std::condition_variable _cv;
+};
+
+template<class T>
+using spsc_ring_t = ring_t<T, true>;
+
 template<class T>
 class shared_t {
 public:
@@ -454,6 +753,9 @@ public:
   template<class T>
   using queue_t = std::shared_ptr<post_t<queue_t<T>>>;
 
+  template<class T>
+  using ring_t = std::shared_ptr<post_t<ring_t<T>>>;
+
   template<class T>
   event_t<T> event(const std::string_view &id) {
     std::lock_guard lg { mutex };
@@ -484,6 +786,24 @@ public:
     return post;
   }
 
+  /**
+   * Like queue(), for posts on the media hot paths
+   */
+  template<class T>
+  ring_t<T> ring(const std::string_view &id) {
+    std::lock_guard lg { mutex };
+
+    auto it = id_to_post.find(id);
+    if(it != std::end(id_to_post)) {
+      return lock<ring_t<T>>(it->second);
+    }
+
+    auto post = std::make_shared<typename ring_t<T>::element_type>(shared_from_this(), 32);
+    id_to_post.emplace(std::pair<std::string, std::weak_ptr<void>> { std::string { id }, post });
+
+    return post;
+  }
+
   void cleanup() {
     std::lock_guard lg { mutex };
 
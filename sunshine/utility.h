@@ -734,6 +734,19 @@ public:
     std::fill_n(_buf.get(), elements, t);
   }
 
+  /**
+   * Unlike the constructors, this doesn't zero the elements,
+   * for buffers that are overwritten before they're read
+   */
+  static buffer_t uninitialized(size_t elements) {
+    buffer_t buffer;
+
+    buffer._els = elements;
+    buffer._buf.reset(new T[elements]);
+
+    return buffer;
+  }
+
   T &operator[](size_t el) {
     return _buf[el];
   }
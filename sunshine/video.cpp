@@ -2,6 +2,7 @@
 // Created by loki on 6/6/19.
 //
 
+#include <algorithm>
 #include <atomic>
 #include <bitset>
 #include <thread>
@@ -15,9 +16,9 @@ extern "C" {
 #include "input.h"
 #include "main.h"
 #include "platform/common.h"
-#include "round_robin.h"
 #include "sync.h"
 #include "video.h"
+#include "yuv.h"
 
 #ifdef _WIN32
 extern "C" {
@@ -25,6 +26,21 @@ extern "C" {
 }
 #endif
 
+// The private context of libx264 is only known to start with the x264 encoder for these versions of libavcodec
+#define SUNSHINE_X264_RFI_AVCODEC_MIN 58
+#define SUNSHINE_X264_RFI_AVCODEC_MAX 61
+
+#if __has_include(<x264.h>) && !defined(_WIN32) && \
+  LIBAVCODEC_VERSION_MAJOR >= SUNSHINE_X264_RFI_AVCODEC_MIN && LIBAVCODEC_VERSION_MAJOR <= SUNSHINE_X264_RFI_AVCODEC_MAX
+#include <dlfcn.h>
+
+extern "C" {
+#include <x264.h>
+}
+
+#define SUNSHINE_X264_RFI
+#endif
+
 using namespace std::literals;
 namespace video {
 
@@ -80,6 +96,20 @@ public:
   int convert(platf::img_t &img) override {
     av_frame_make_writable(sw_frame.get());
 
+    if(matrix) {
+      yuv::planes_t planes {
+        sw_frame->data[0],
+        sw_frame->data[1],
+        sw_frame->format == AV_PIX_FMT_NV12 ? nullptr : sw_frame->data[2],
+        sw_frame->linesize[0],
+        sw_frame->linesize[1],
+      };
+
+      converter.convert(*matrix, img.data, img.row_pitch, img.width, img.height, planes);
+
+      return transfer();
+    }
+
     const int linesizes[2] {
       img.row_pitch, 0
     };
@@ -104,6 +134,10 @@ public:
       return -1;
     }
 
+    return transfer();
+  }
+
+  int transfer() {
     // If frame is not a software frame, it means we still need to transfer from main memory
     // to vram memory
     if(frame->hw_frames_ctx) {
@@ -140,6 +174,16 @@ public:
       sws_getCoefficients(SWS_CS_DEFAULT), 0,
       sws_getCoefficients(colorspace), color_range - 1,
       0, 1 << 16, 1 << 16);
+
+    // yuv only knows the matrices of colors[], anything else is left to swscale
+    matrix.reset();
+    if(direct && (colorspace == SWS_CS_SMPTE170M || colorspace == SWS_CS_ITU709)) {
+      auto &color = colors[colorspace == SWS_CS_ITU709 ? 2 : 0];
+
+      matrix = yuv::make_matrix(color.color_vec_y[0], color.color_vec_y[2], color_range > 1);
+    }
+
+    BOOST_LOG(debug) << "Software colour conversion: "sv << (matrix ? yuv::name() : "swscale"sv);
   }
 
   /**
@@ -214,6 +258,15 @@ public:
     offsetUV     = (offsetW + offsetH * frame->width / 2) / 2;
     offsetY      = offsetW + offsetH * frame->width;
 
+    // swscale is only needed for scaling, or for formats yuv doesn't generate
+    direct = in_width == frame->width && in_height == frame->height &&
+             !(in_width % 2) && !(in_height % 2) &&
+             (format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_NV12);
+
+    if(direct) {
+      converter.start(std::clamp((int)std::thread::hardware_concurrency(), 1, 8) - 1);
+    }
+
     sws.reset(sws_getContext(
       in_width, in_height, AV_PIX_FMT_BGR0,
       out_width, out_height, format,
@@ -234,6 +287,13 @@ public:
   // offset of input image to output frame in pixels
   int offsetUV;
   int offsetY;
+
+  // The input and output resolution are the same
+  bool direct;
+
+  // Set when yuv converts the images instead of swscale
+  std::optional<yuv::matrix_t> matrix;
+  yuv::converter_t converter;
 };
 
 enum flag_e {
@@ -338,6 +398,11 @@ public:
 
     inject = other.inject;
 
+    dropped_packets = other.dropped_packets;
+    packet_dropped  = other.packet_dropped;
+
+    bitrate_adjustable = other.bitrate_adjustable;
+
     return *this;
   }
 
@@ -351,13 +416,25 @@ public:
 
   // inject sps/vps data into idr pictures
   int inject;
+
+  // Packets the packet queue had no room for
+  std::uint64_t dropped_packets = 0;
+
+  // Set by encode() when it dropped a packet, the client can't decode anything until the next keyframe
+  bool packet_dropped = false;
+
+  // The rate control can be changed while encoding, see set_bitrate()
+  bool bitrate_adjustable = false;
 };
 
 struct sync_session_ctx_t {
   safe::signal_t *join_event;
   safe::mail_raw_t::event_t<bool> shutdown_event;
-  safe::mail_raw_t::queue_t<packet_t> packets;
+  safe::mail_raw_t::ring_t<packet_t> packets;
   safe::mail_raw_t::event_t<bool> idr_events;
+  safe::mail_raw_t::queue_t<std::int64_t> invalidate_ref_frames_events;
+  safe::mail_raw_t::event_t<int> bitrate_events;
+  safe::mail_raw_t::event_t<bool> bitrate_fixed_events;
   safe::mail_raw_t::event_t<input::touch_port_t> touch_port_events;
 
   config_t config;
@@ -380,6 +457,132 @@ struct capture_ctx_t {
   int framerate;
 };
 
+/**
+ * The images captureThread captures into.
+ * An image returns to the pool once the last session releases it,
+ * so a frame is never overwritten while it's being encoded
+ */
+class img_pool_t : public std::enable_shared_from_this<img_pool_t> {
+public:
+  static constexpr auto report_interval = 10s;
+
+  /**
+   * Replace the images of the pool by count new images of disp
+   * returns -1 on failure
+   */
+  int alloc(platf::display_t &disp, int count) {
+    clear();
+
+    std::lock_guard lg { _lock };
+    for(auto x = 0; x < count; ++x) {
+      auto img = disp.alloc_img();
+      if(!img) {
+        BOOST_LOG(error) << "Couldn't initialize an image"sv;
+        return -1;
+      }
+
+      _imgs.emplace_back(std::move(img));
+    }
+
+    return 0;
+  }
+
+  /**
+   * Release the images, those still in use are released once the sessions are done with them
+   */
+  void clear() {
+    std::vector<std::shared_ptr<platf::img_t>> imgs;
+
+    std::lock_guard lg { _lock };
+    ++_generation;
+
+    // Some classes of images contain references to the display, they're released after the lock
+    imgs.swap(_imgs);
+  }
+
+  /**
+   * Wait up to timeout for an image none of the sessions is using
+   * returns nullptr on timeout
+   */
+  std::shared_ptr<platf::img_t> pop(std::chrono::nanoseconds timeout) {
+    std::unique_lock ul { _lock };
+
+    if(_imgs.empty()) {
+      ++_exhausted;
+
+      auto begin = std::chrono::steady_clock::now();
+      auto ready = _cv.wait_for(ul, timeout, [this]() { return !_imgs.empty(); });
+      _wait_time += std::chrono::steady_clock::now() - begin;
+
+      if(!ready) {
+        ++_skipped;
+
+        return nullptr;
+      }
+    }
+
+    auto img = std::move(_imgs.back());
+    _imgs.pop_back();
+
+    auto img_p = img.get();
+    return std::shared_ptr<platf::img_t> { img_p, [pool = shared_from_this(), img = std::move(img), generation = _generation](platf::img_t *) mutable {
+                                            pool->push(std::move(img), generation);
+                                          } };
+  }
+
+  /**
+   * Log how often the capture thread ran out of images
+   */
+  void report(std::chrono::steady_clock::time_point now) {
+    if(now - _last_report < report_interval) {
+      return;
+    }
+
+    _last_report = now;
+
+    std::lock_guard lg { _lock };
+    if(!_exhausted) {
+      return;
+    }
+
+    BOOST_LOG(debug)
+      << "Capture: all images in use ["sv << _exhausted << "] times, waited ["sv
+      << std::chrono::duration_cast<std::chrono::milliseconds>(_wait_time).count() << "ms], skipped ["sv << _skipped << "] frames"sv;
+
+    _exhausted = 0;
+    _skipped   = 0;
+    _wait_time = 0ns;
+  }
+
+private:
+  void push(std::shared_ptr<platf::img_t> &&img, std::uint64_t generation) {
+    {
+      std::lock_guard lg { _lock };
+
+      // The image belongs to a display that no longer exists
+      if(generation != _generation) {
+        return;
+      }
+
+      _imgs.emplace_back(std::move(img));
+    }
+
+    _cv.notify_one();
+  }
+
+  std::vector<std::shared_ptr<platf::img_t>> _imgs;
+  std::uint64_t _generation { 0 };
+
+  // Only used by the capture thread
+  std::uint64_t _exhausted { 0 };
+  std::uint64_t _skipped { 0 };
+  std::chrono::nanoseconds _wait_time { 0 };
+  std::chrono::steady_clock::time_point _last_report;
+
+  std::mutex _lock;
+  std::condition_variable _cv;
+};
+
 struct capture_thread_async_ctx_t {
   std::shared_ptr<safe::queue_t<capture_ctx_t>> capture_ctx_queue;
   std::thread capture_thread;
@@ -610,31 +813,35 @@ void captureThread(
   }
   display_wp = disp;
 
-  std::vector<std::shared_ptr<platf::img_t>> imgs(12);
-  auto round_robin = util::make_round_robin<std::shared_ptr<platf::img_t>>(std::begin(imgs), std::end(imgs));
-
-  for(auto &img : imgs) {
-    img = disp->alloc_img();
-    if(!img) {
-      BOOST_LOG(error) << "Couldn't initialize an image"sv;
-      return;
-    }
+  auto imgs = std::make_shared<img_pool_t>();
+  if(imgs->alloc(*disp, 12)) {
+    return;
   }
 
+  // If no image is released within a frame, the frame is skipped
+  auto frame_interval = std::chrono::nanoseconds { 1s } / capture_ctxs.front().framerate;
+
   while(capture_ctx_queue->running()) {
     bool artificial_reinit = false;
 
     auto status = disp->capture([&](std::shared_ptr<platf::img_t> &img) -> std::shared_ptr<platf::img_t> {
-      KITTY_WHILE_LOOP(auto capture_ctx = std::begin(capture_ctxs), capture_ctx != std::end(capture_ctxs), {
-        if(!capture_ctx->images->running()) {
-          capture_ctx = capture_ctxs.erase(capture_ctx);
+      auto next_img = imgs->pop(frame_interval);
+      if(next_img) {
+        KITTY_WHILE_LOOP(auto capture_ctx = std::begin(capture_ctxs), capture_ctx != std::end(capture_ctxs), {
+          if(!capture_ctx->images->running()) {
+            capture_ctx = capture_ctxs.erase(capture_ctx);
 
-          continue;
-        }
+            continue;
+          }
 
-        capture_ctx->images->raise(img);
-        ++capture_ctx;
-      })
+          capture_ctx->images->raise(img);
+          ++capture_ctx;
+        })
+      }
+      else {
+        // The sessions are still busy with every other image, skip this frame and capture into img again
+        next_img = img;
+      }
 
       if(!capture_ctx_queue->running()) {
         return nullptr;
@@ -650,12 +857,11 @@ void captureThread(
         return nullptr;
       }
 
-      auto &next_img = *round_robin++;
-      while(next_img.use_count() > 1) {}
+      imgs->report(std::chrono::steady_clock::now());
 
       return next_img;
     },
-      *round_robin++, &display_cursor);
+      imgs->pop(frame_interval), &display_cursor);
 
 
     if(artificial_reinit && status != platf::capture_e::error) {
@@ -669,9 +875,7 @@ void captureThread(
       reinit_event.raise(true);
 
       // Some classes of images contain references to the display --> display won't delete unless img is deleted
-      for(auto &img : imgs) {
-        img.reset();
-      }
+      imgs->clear();
 
       // display_wp is modified in this thread only
       // Wait for the other shared_ptr's of display to be destroyed.
@@ -695,12 +899,8 @@ void captureThread(
       display_wp = disp;
 
       // Re-allocate images
-      for(auto &img : imgs) {
-        img = disp->alloc_img();
-        if(!img) {
-          BOOST_LOG(error) << "Couldn't initialize an image"sv;
-          return;
-        }
+      if(imgs->alloc(*disp, 12)) {
+        return;
       }
 
       reinit_event.reset();
@@ -717,7 +917,59 @@ void captureThread(
   }
 }
 
-int encode(int64_t frame_nr, session_t &session, frame_t::pointer frame, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data) {
+/**
+ * Locate the replacements in a keyframe, so the packetizer doesn't have to search the whole frame.
+ *
+ * Each replacement starts with a start code and applies to a parameter set or to the first slice.
+ * Start codes can't occur inside a NAL unit, so only the start codes up to the first slice are inspected.
+ * Like std::search, each replacement is applied to its first occurrence.
+ */
+static void find_splices(packet_raw_t &packet, const std::vector<packet_raw_t::replace_t> &replacements, bool h264) {
+  constexpr auto start_code = "\000\000\001"sv;
+
+  std::string_view frame { (char *)packet.data, (std::size_t)packet.size };
+
+  std::vector<bool> found(replacements.size());
+
+  auto pos = frame.find(start_code);
+  while(pos != std::string_view::npos && pos + start_code.size() < frame.size()) {
+    // A four byte start code begins one byte earlier
+    auto begin = pos > 0 && frame[pos - 1] == 0 ? pos - 1 : pos;
+
+    for(auto x = 0; x < replacements.size(); ++x) {
+      auto &old = replacements[x].old;
+      if(found[x]) {
+        continue;
+      }
+
+      for(auto offset = begin; offset <= pos; ++offset) {
+        if(frame.compare(offset, old.size(), old) == 0) {
+          packet.splices.emplace_back(packet_raw_t::splice_t { offset, old.size(), replacements[x]._new });
+          found[x] = true;
+
+          break;
+        }
+      }
+    }
+
+    auto nal_header = (std::uint8_t)frame[pos + start_code.size()];
+    auto slice      = h264 ?
+                        (nal_header & 0x1F) >= 1 && (nal_header & 0x1F) <= 5 :
+                        ((nal_header >> 1) & 0x3F) < 32;
+
+    if(slice) {
+      break;
+    }
+
+    pos = frame.find(start_code, pos + start_code.size());
+  }
+
+  std::sort(std::begin(packet.splices), std::end(packet.splices), [](auto &l, auto &r) {
+    return l.offset < r.offset;
+  });
+}
+
+int encode(int64_t frame_nr, session_t &session, frame_t::pointer frame, safe::mail_raw_t::ring_t<packet_t> &packets, void *channel_data) {
   frame->pts = frame_nr;
 
   auto &ctx = session.ctx;
@@ -770,14 +1022,35 @@ int encode(int64_t frame_nr, session_t &session, frame_t::pointer frame, safe::m
         std::string_view((char *)std::begin(sps._new), sps._new.size()));
     }
 
-    packet->replacements = &session.replacements;
+    if(packet->flags & AV_PKT_FLAG_KEY) {
+      find_splices(*packet, session.replacements, ctx->codec_id == AV_CODEC_ID_H264);
+    }
+
     packet->channel_data = channel_data;
-    packets->raise(std::move(packet));
+
+    // The queue is shared by the encoders of every session, so only the packet being queued can be dropped
+    if(!packets->raise(std::move(packet))) {
+      ++session.dropped_packets;
+      session.packet_dropped = true;
+    }
   }
 
   return 0;
 }
 
+/**
+ * Set the constant bitrate of the encoder
+ *
+ * bitrate --> kbps
+ */
+static void set_rate_control(AVCodecContext *ctx, int bitrate, bool hardware) {
+  auto bits           = (std::int64_t)bitrate * (hardware ? 1000 : 800); // software bitrate overshoots by ~20%
+  ctx->rc_max_rate    = bits;
+  ctx->rc_buffer_size = bits / 10;
+  ctx->bit_rate       = bits;
+  ctx->rc_min_rate    = bits;
+}
+
 std::optional<session_t> make_session(const encoder_t &encoder, const config_t &config, int width, int height, std::shared_ptr<platf::hwdevice_t> &&hwdevice) {
   bool hardware = encoder.dev_type != AV_HWDEVICE_TYPE_NONE;
 
@@ -930,11 +1203,7 @@ std::optional<session_t> make_session(const encoder_t &encoder, const config_t &
   }
 
   if(video_format[encoder_t::CBR]) {
-    auto bitrate        = config.bitrate * (hardware ? 1000 : 800); // software bitrate overshoots by ~20%
-    ctx->rc_max_rate    = bitrate;
-    ctx->rc_buffer_size = bitrate / 10;
-    ctx->bit_rate       = bitrate;
-    ctx->rc_min_rate    = bitrate;
+    set_rate_control(ctx.get(), config.bitrate, hardware);
   }
   else if(video_format.qp) {
     handle_option(*video_format.qp);
@@ -999,9 +1268,140 @@ std::optional<session_t> make_session(const encoder_t &encoder, const config_t &
     session.replacements.emplace_back(nalu_prefix.substr(1), nalu_prefix);
   }
 
+  // libx264 passes changes to the rate control to x264_encoder_reconfig() before encoding the next frame
+  session.bitrate_adjustable = std::string_view { codec->name } == "libx264"sv && video_format[encoder_t::CBR];
+
   return std::make_optional(std::move(session));
 }
 
+/**
+ * Change the target bitrate of a running encoder, without forcing a keyframe
+ *
+ * bitrate --> kbps
+ * returns -1 if the encoder can't be reconfigured
+ */
+int set_bitrate(session_t &session, int bitrate) {
+  if(!session.bitrate_adjustable) {
+    return -1;
+  }
+
+  set_rate_control(session.ctx.get(), bitrate, false);
+
+  return 0;
+}
+
+/**
+ * Let the bitrate controller of the stream know it can't adapt the bitrate of this session
+ */
+static void report_bitrate_fixed(const session_t &session, safe::mail_raw_t::event_t<bool> &bitrate_fixed_events) {
+  if(!session.bitrate_adjustable) {
+    BOOST_LOG(info) << "Encoder can't change its bitrate: adaptive bitrate is disabled"sv;
+    bitrate_fixed_events->raise(true);
+  }
+}
+
+#ifdef SUNSHINE_X264_RFI
+/**
+ * ffmpeg doesn't expose the x264 encoder, it's the third member of the private context of libx264:
+ *   typedef struct X264Context { AVClass *class; x264_param_t params; x264_t *enc; ... } X264Context;
+ */
+struct x264_context_t {
+  const AVClass *av_class;
+  x264_param_t params;
+  x264_t *enc;
+};
+
+using invalidate_reference_f = int (*)(x264_t *, int64_t);
+
+static invalidate_reference_f load_invalidate_reference() {
+  // The headers may not match the libavcodec that is loaded
+  auto avcodec_major = avcodec_version() >> 16;
+  if(avcodec_major < SUNSHINE_X264_RFI_AVCODEC_MIN || avcodec_major > SUNSHINE_X264_RFI_AVCODEC_MAX) {
+    BOOST_LOG(info) << "Unknown libavcodec version ["sv << avcodec_major << "]: reference frame invalidation is disabled"sv;
+
+    return nullptr;
+  }
+
+  // The layout of x264_param_t changes with the build of x264, which is the suffix of x264_encoder_open
+  auto encoder_open = "x264_encoder_open_"s + std::to_string(X264_BUILD);
+  if(!dlsym(RTLD_DEFAULT, encoder_open.c_str())) {
+    BOOST_LOG(info) << "Loaded libx264 doesn't match build ["sv << X264_BUILD << "]: reference frame invalidation is disabled"sv;
+
+    return nullptr;
+  }
+
+  return (invalidate_reference_f)dlsym(RTLD_DEFAULT, "x264_encoder_invalidate_reference");
+}
+#endif
+
+/**
+ * Stop the encoder from referencing first_frame and any frame after it,
+ * the next frame only references frames the client has decoded correctly.
+ *
+ * returns -1 if the encoder doesn't support it, a keyframe is needed instead
+ */
+int invalidate_ref_frames(session_t &session, std::int64_t first_frame) {
+#ifdef SUNSHINE_X264_RFI
+  if(!config::video.sw.ref_invalidation) {
+    return -1;
+  }
+
+  static auto invalidate_reference = load_invalidate_reference();
+
+  auto &ctx = session.ctx;
+  if(!invalidate_reference || std::string_view { ctx->codec->name } != "libx264"sv) {
+    return -1;
+  }
+
+  auto x264_ctx = (x264_context_t *)ctx->priv_data;
+
+  // libavcodec copies the dimensions of the codec context into the x264 parameters, verify the layout before using enc
+  if(x264_ctx->params.i_width != ctx->width || x264_ctx->params.i_height != ctx->height || !x264_ctx->enc) {
+    BOOST_LOG(debug) << "Unexpected layout of the libx264 context: falling back to a keyframe"sv;
+
+    return -1;
+  }
+
+  auto enc = x264_ctx->enc;
+
+  // x264 doesn't keep frames older than the last IDR frame, those are recovered already
+  return invalidate_reference(enc, first_frame) ? -1 : 0;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * The client may report multiple ranges of lost frames before the next frame is encoded
+ */
+static std::optional<std::int64_t> pop_first_lost_frame(safe::mail_raw_t::queue_t<std::int64_t> &events) {
+  std::optional<std::int64_t> first_frame;
+  while(events->peek()) {
+    auto frame  = *events->pop();
+    first_frame = first_frame ? std::min(*first_frame, frame) : frame;
+  }
+
+  return first_frame;
+}
+
+/**
+ * If encode() dropped a packet, request a keyframe so the client recovers
+ */
+static void request_idr_on_drop(session_t &session, safe::mail_raw_t::event_t<bool> &idr_events) {
+  if(session.packet_dropped) {
+    session.packet_dropped = false;
+
+    BOOST_LOG(debug) << "Video: packet queue full, dropped a packet"sv;
+    idr_events->raise(true);
+  }
+}
+
+static void log_dropped_packets(const session_t &session) {
+  if(session.dropped_packets) {
+    BOOST_LOG(info) << "Video: dropped ["sv << session.dropped_packets << "] packets the stream couldn't keep up with"sv;
+  }
+}
+
 void encode_run(
   int &frame_nr, // Store progress of the frame number
   safe::mail_t mail,
@@ -1021,14 +1421,30 @@ void encode_run(
   auto frame = session->device->frame;
 
   auto shutdown_event = mail->event<bool>(mail::shutdown);
-  auto packets        = mail::man->queue<packet_t>(mail::video_packets);
+  auto packets        = mail::man->ring<packet_t>(mail::video_packets);
   auto idr_events     = mail->event<bool>(mail::idr);
+  auto bitrate_events = mail->event<int>(mail::bitrate);
+
+  auto invalidate_ref_frames_events = mail->queue<std::int64_t>(mail::invalidate_ref_frames);
+
+  auto bitrate_fixed_events = mail->event<bool>(mail::bitrate_fixed);
+  report_bitrate_fixed(*session, bitrate_fixed_events);
+
+  auto fg = util::fail_guard([&]() {
+    log_dropped_packets(*session);
+  });
 
   while(true) {
     if(shutdown_event->peek() || reinit_event.peek() || !images->running()) {
       break;
     }
 
+    if(auto first_frame = pop_first_lost_frame(invalidate_ref_frames_events)) {
+      if(invalidate_ref_frames(*session, *first_frame)) {
+        idr_events->raise(true);
+      }
+    }
+
     if(idr_events->peek()) {
       frame->pict_type = AV_PICTURE_TYPE_I;
       frame->key_frame = 1;
@@ -1036,6 +1452,13 @@ void encode_run(
       idr_events->pop();
     }
 
+    if(bitrate_events->peek()) {
+      auto bitrate = *bitrate_events->pop();
+      if(set_bitrate(*session, bitrate)) {
+        BOOST_LOG(debug) << "Encoder can't change its bitrate to ["sv << bitrate << "] kbps"sv;
+      }
+    }
+
     if(!frame->key_frame || images->peek()) {
       if(auto img = images->pop(100ms)) {
         session->device->convert(*img);
@@ -1053,6 +1476,8 @@ void encode_run(
       return;
     }
 
+    request_idr_on_drop(*session, idr_events);
+
     frame->pict_type = AV_PICTURE_TYPE_NONE;
     frame->key_frame = 0;
   }
@@ -1105,6 +1530,8 @@ std::optional<sync_session_t> make_synced_session(platf::display_t *disp, const
     return std::nullopt;
   }
 
+  report_bitrate_fixed(*session, ctx.bitrate_fixed_events);
+
   encode_session.session = std::move(*session);
 
   return std::move(encode_session);
@@ -1197,6 +1624,8 @@ encode_e encode_run_sync(
         auto frame = pos->session.device->frame;
         auto ctx   = pos->ctx;
         if(ctx->shutdown_event->peek()) {
+          log_dropped_packets(pos->session);
+
           // Let waiting thread know it can delete shutdown_event
           ctx->join_event->raise(true);
 
@@ -1212,6 +1641,12 @@ encode_e encode_run_sync(
           continue;
         }
 
+        if(auto first_frame = pop_first_lost_frame(ctx->invalidate_ref_frames_events)) {
+          if(invalidate_ref_frames(pos->session, *first_frame)) {
+            ctx->idr_events->raise(true);
+          }
+        }
+
         if(ctx->idr_events->peek()) {
           frame->pict_type = AV_PICTURE_TYPE_I;
           frame->key_frame = 1;
@@ -1219,6 +1654,13 @@ encode_e encode_run_sync(
           ctx->idr_events->pop();
         }
 
+        if(ctx->bitrate_events->peek()) {
+          auto bitrate = *ctx->bitrate_events->pop();
+          if(set_bitrate(pos->session, bitrate)) {
+            BOOST_LOG(debug) << "Encoder can't change its bitrate to ["sv << bitrate << "] kbps"sv;
+          }
+        }
+
         if(pos->session.device->convert(*img)) {
           BOOST_LOG(error) << "Could not convert image"sv;
           ctx->shutdown_event->raise(true);
@@ -1233,6 +1675,8 @@ encode_e encode_run_sync(
           continue;
         }
 
+        request_idr_on_drop(pos->session, ctx->idr_events);
+
         frame->pict_type = AV_PICTURE_TYPE_NONE;
         frame->key_frame = 0;
 
@@ -1375,8 +1819,11 @@ void capture(
     ref->encode_session_ctx_queue.raise(sync_session_ctx_t {
       &join_event,
       mail->event<bool>(mail::shutdown),
-      mail::man->queue<packet_t>(mail::video_packets),
+      mail::man->ring<packet_t>(mail::video_packets),
       std::move(idr_events),
+      mail->queue<std::int64_t>(mail::invalidate_ref_frames),
+      mail->event<int>(mail::bitrate),
+      mail->event<bool>(mail::bitrate_fixed),
       mail->event<input::touch_port_t>(mail::touch_port),
       config,
       1,
@@ -1422,7 +1869,7 @@ int validate_config(std::shared_ptr<platf::display_t> &disp, const encoder_t &en
 
   frame->pict_type = AV_PICTURE_TYPE_I;
 
-  auto packets = mail::man->queue<packet_t>(mail::video_packets);
+  auto packets = mail::man->ring<packet_t>(mail::video_packets);
   while(!packets->peek()) {
     if(encode(1, *session, frame, packets, nullptr)) {
       return -1;
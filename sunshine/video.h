@@ -51,7 +51,14 @@ struct packet_raw_t : public AVPacket {
     replace_t(std::string_view old, std::string_view _new) noexcept : old { std::move(old) }, _new { std::move(_new) } {}
   };
 
-  std::vector<replace_t> *replacements;
+  struct splice_t {
+    std::size_t offset;
+    std::size_t size;
+    std::string_view _new;
+  };
+
+  // Where the SPS/VPS replacements apply in a keyframe, sorted by offset
+  std::vector<splice_t> splices;
 
   void *channel_data;
 };
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SUNSHINE_YUV_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SUNSHINE_YUV_NEON
+#endif
+
+#include "main.h"
+#include "yuv.h"
+
+using namespace std::literals;
+namespace yuv {
+// Converts the pixels [begin, end) of two consecutive rows
+// returns the offset of the first pixel it didn't convert
+using rows_f = int (*)(const matrix_t &m, const std::uint8_t *row0, const std::uint8_t *row1, std::uint8_t *y0, std::uint8_t *y1, std::uint8_t *u, std::uint8_t *v, int begin, int end);
+
+matrix_t make_matrix(float Kr, float Kb, bool full_range) {
+  constexpr auto one = 1 << luma_shift;
+
+  auto y_scale  = full_range ? 1.0f : 219.0f / 255.0f;
+  auto uv_scale = full_range ? 1.0f : 224.0f / 255.0f;
+  auto y_offset = full_range ? 0 : 16;
+
+  auto fixed = [](float x) {
+    return (std::int16_t)std::lround(x * one);
+  };
+
+  matrix_t m;
+
+  m.y[0] = fixed(y_scale * Kb);
+  m.y[2] = fixed(y_scale * Kr);
+  m.u[0] = fixed(uv_scale * 0.5f);
+  m.u[2] = fixed(-uv_scale * Kr / (2.0f * (1.0f - Kb)));
+  m.v[0] = fixed(-uv_scale * Kb / (2.0f * (1.0f - Kr)));
+  m.v[2] = fixed(uv_scale * 0.5f);
+
+  // Green absorbs the rounding errors, so white maps to the top of the range and grey has no chroma
+  m.y[1] = fixed(y_scale) - m.y[0] - m.y[2];
+  m.u[1] = -m.u[0] - m.u[2];
+  m.v[1] = -m.v[0] - m.v[2];
+
+  m.y[3] = m.u[3] = m.v[3] = 0;
+
+  m.y_add  = (y_offset << luma_shift) + (1 << (luma_shift - 1));
+  m.uv_add = (128 << chroma_shift) + (1 << (chroma_shift - 1));
+
+  return m;
+}
+
+static inline std::uint8_t clamp_u8(int x) {
+  return (std::uint8_t)std::clamp(x, 0, 255);
+}
+
+static inline std::uint8_t luma_scalar(const matrix_t &m, const std::uint8_t *pixel) {
+  return clamp_u8((m.y[0] * pixel[0] + m.y[1] * pixel[1] + m.y[2] * pixel[2] + m.y_add) >> luma_shift);
+}
+
+static inline std::uint8_t chroma_scalar(const std::int16_t *c, int add, int b, int g, int r) {
+  return clamp_u8((c[0] * b + c[1] * g + c[2] * r + add) >> chroma_shift);
+}
+
+static int rows_scalar(const matrix_t &m, const std::uint8_t *row0, const std::uint8_t *row1, std::uint8_t *y0, std::uint8_t *y1, std::uint8_t *u, std::uint8_t *v, int begin, int end) {
+  for(auto x = begin; x < end; x += 2) {
+    auto p00 = row0 + x * 4;
+    auto p01 = p00 + 4;
+    auto p10 = row1 + x * 4;
+    auto p11 = p10 + 4;
+
+    y0[x]     = luma_scalar(m, p00);
+    y0[x + 1] = luma_scalar(m, p01);
+    y1[x]     = luma_scalar(m, p10);
+    y1[x + 1] = luma_scalar(m, p11);
+
+    auto b = p00[0] + p01[0] + p10[0] + p11[0];
+    auto g = p00[1] + p01[1] + p10[1] + p11[1];
+    auto r = p00[2] + p01[2] + p10[2] + p11[2];
+
+    auto cb = chroma_scalar(m.u, m.uv_add, b, g, r);
+    auto cr = chroma_scalar(m.v, m.uv_add, b, g, r);
+
+    if(v) {
+      u[x / 2] = cb;
+      v[x / 2] = cr;
+    }
+    else {
+      u[x]     = cb;
+      u[x + 1] = cr;
+    }
+  }
+
+  return end;
+}
+
+#ifdef SUNSHINE_YUV_X86
+__attribute__((target("avx2"))) static inline __m256i coefs_avx2(const std::int16_t *c) {
+  return _mm256_setr_epi16(
+    c[0], c[1], c[2], c[3], c[0], c[1], c[2], c[3],
+    c[0], c[1], c[2], c[3], c[0], c[1], c[2], c[3]);
+}
+
+/**
+ * lo, hi --> 16 bits per channel, lane 0 holds pixels [0, 1] and [2, 3], lane 1 holds [4, 5] and [6, 7]
+ * returns the dot product of each pixel with coefs in lane 0 [0, 1, 2, 3] and lane 1 [4, 5, 6, 7]
+ */
+__attribute__((target("avx2"))) static inline __m256i dot_avx2(__m256i lo, __m256i hi, __m256i coefs) {
+  return _mm256_hadd_epi32(_mm256_madd_epi16(lo, coefs), _mm256_madd_epi16(hi, coefs));
+}
+
+/**
+ * px --> 32 pixels
+ * returns the luma of each pixel
+ */
+__attribute__((target("avx2"))) static inline __m256i luma_avx2(const __m256i *px, __m256i coefs, __m256i add) {
+  auto zero = _mm256_setzero_si256();
+
+  __m256i luma[4];
+  for(auto x = 0; x < 4; ++x) {
+    auto dot = dot_avx2(_mm256_unpacklo_epi8(px[x], zero), _mm256_unpackhi_epi8(px[x], zero), coefs);
+    luma[x]  = _mm256_srai_epi32(_mm256_add_epi32(dot, add), luma_shift);
+  }
+
+  // pack works within 128 bit lanes, each pack is followed by a permute to restore the order of the pixels
+  auto lo = _mm256_permute4x64_epi64(_mm256_packs_epi32(luma[0], luma[1]), _MM_SHUFFLE(3, 1, 2, 0));
+  auto hi = _mm256_permute4x64_epi64(_mm256_packs_epi32(luma[2], luma[3]), _MM_SHUFFLE(3, 1, 2, 0));
+
+  return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/**
+ * r0, r1 --> 8 pixels of two consecutive rows
+ * returns the sums of the four 2x2 blocks, 16 bits per channel, in lane 0 [0, 1] and lane 1 [2, 3]
+ */
+__attribute__((target("avx2"))) static inline __m256i sum_avx2(__m256i r0, __m256i r1) {
+  auto zero = _mm256_setzero_si256();
+
+  auto lo = _mm256_add_epi16(_mm256_unpacklo_epi8(r0, zero), _mm256_unpacklo_epi8(r1, zero));
+  auto hi = _mm256_add_epi16(_mm256_unpackhi_epi8(r0, zero), _mm256_unpackhi_epi8(r1, zero));
+
+  return _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_unpackhi_epi64(lo, hi));
+}
+
+/**
+ * sums --> the sums of 16 blocks of 2x2 pixels
+ * returns the chroma of each block
+ */
+__attribute__((target("avx2"))) static inline __m128i chroma_avx2(const __m256i *sums, __m256i coefs, __m256i add) {
+  auto order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+
+  auto lo = _mm256_permutevar8x32_epi32(dot_avx2(sums[0], sums[1], coefs), order);
+  auto hi = _mm256_permutevar8x32_epi32(dot_avx2(sums[2], sums[3], coefs), order);
+
+  lo = _mm256_srai_epi32(_mm256_add_epi32(lo, add), chroma_shift);
+  hi = _mm256_srai_epi32(_mm256_add_epi32(hi, add), chroma_shift);
+
+  auto chroma = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+  return _mm_packus_epi16(_mm256_castsi256_si128(chroma), _mm256_extracti128_si256(chroma, 1));
+}
+
+__attribute__((target("avx2"))) static int rows_avx2(const matrix_t &m, const std::uint8_t *row0, const std::uint8_t *row1, std::uint8_t *y0, std::uint8_t *y1, std::uint8_t *u, std::uint8_t *v, int begin, int end) {
+  auto coefs_y = coefs_avx2(m.y);
+  auto coefs_u = coefs_avx2(m.u);
+  auto coefs_v = coefs_avx2(m.v);
+
+  auto y_add  = _mm256_set1_epi32(m.y_add);
+  auto uv_add = _mm256_set1_epi32(m.uv_add);
+
+  for(; begin + 32 <= end; begin += 32) {
+    __m256i px0[4], px1[4], sums[4];
+    for(auto x = 0; x < 4; ++x) {
+      px0[x]  = _mm256_loadu_si256((const __m256i *)(row0 + (begin + x * 8) * 4));
+      px1[x]  = _mm256_loadu_si256((const __m256i *)(row1 + (begin + x * 8) * 4));
+      sums[x] = sum_avx2(px0[x], px1[x]);
+    }
+
+    _mm256_storeu_si256((__m256i *)(y0 + begin), luma_avx2(px0, coefs_y, y_add));
+    _mm256_storeu_si256((__m256i *)(y1 + begin), luma_avx2(px1, coefs_y, y_add));
+
+    auto cb = chroma_avx2(sums, coefs_u, uv_add);
+    auto cr = chroma_avx2(sums, coefs_v, uv_add);
+
+    if(v) {
+      _mm_storeu_si128((__m128i *)(u + begin / 2), cb);
+      _mm_storeu_si128((__m128i *)(v + begin / 2), cr);
+    }
+    else {
+      _mm_storeu_si128((__m128i *)(u + begin), _mm_unpacklo_epi8(cb, cr));
+      _mm_storeu_si128((__m128i *)(u + begin + 16), _mm_unpackhi_epi8(cb, cr));
+    }
+  }
+
+  return begin;
+}
+#endif
+
+#ifdef SUNSHINE_YUV_NEON
+/**
+ * b, g, r --> 8 values per channel
+ * returns the dot product of each value with c, shifted right
+ */
+template<int shift>
+static inline int16x8_t dot_neon(const std::int16_t *c, int16x8_t b, int16x8_t g, int16x8_t r, int32x4_t add) {
+  auto lo = vmlal_n_s16(vmlal_n_s16(vmlal_n_s16(add, vget_low_s16(b), c[0]), vget_low_s16(g), c[1]), vget_low_s16(r), c[2]);
+  auto hi = vmlal_n_s16(vmlal_n_s16(vmlal_n_s16(add, vget_high_s16(b), c[0]), vget_high_s16(g), c[1]), vget_high_s16(r), c[2]);
+
+  return vcombine_s16(vshrn_n_s32(lo, shift), vshrn_n_s32(hi, shift));
+}
+
+static inline int16x8_t widen_neon(uint8x8_t x) {
+  return vreinterpretq_s16_u16(vmovl_u8(x));
+}
+
+/**
+ * px --> 16 pixels, split by channel
+ * returns the luma of each pixel
+ */
+static inline uint8x16_t luma_neon(const matrix_t &m, const uint8x16x4_t &px, int32x4_t add) {
+  auto lo = dot_neon<luma_shift>(m.y, widen_neon(vget_low_u8(px.val[0])), widen_neon(vget_low_u8(px.val[1])), widen_neon(vget_low_u8(px.val[2])), add);
+  auto hi = dot_neon<luma_shift>(m.y, widen_neon(vget_high_u8(px.val[0])), widen_neon(vget_high_u8(px.val[1])), widen_neon(vget_high_u8(px.val[2])), add);
+
+  return vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi));
+}
+
+static int rows_neon(const matrix_t &m, const std::uint8_t *row0, const std::uint8_t *row1, std::uint8_t *y0, std::uint8_t *y1, std::uint8_t *u, std::uint8_t *v, int begin, int end) {
+  auto y_add  = vdupq_n_s32(m.y_add);
+  auto uv_add = vdupq_n_s32(m.uv_add);
+
+  for(; begin + 16 <= end; begin += 16) {
+    auto px0 = vld4q_u8(row0 + begin * 4);
+    auto px1 = vld4q_u8(row1 + begin * 4);
+
+    vst1q_u8(y0 + begin, luma_neon(m, px0, y_add));
+    vst1q_u8(y1 + begin, luma_neon(m, px1, y_add));
+
+    // The sums of the 2x2 blocks
+    int16x8_t sums[3];
+    for(auto c = 0; c < 3; ++c) {
+      sums[c] = vreinterpretq_s16_u16(vaddq_u16(vpaddlq_u8(px0.val[c]), vpaddlq_u8(px1.val[c])));
+    }
+
+    auto cb = vqmovun_s16(dot_neon<chroma_shift>(m.u, sums[0], sums[1], sums[2], uv_add));
+    auto cr = vqmovun_s16(dot_neon<chroma_shift>(m.v, sums[0], sums[1], sums[2], uv_add));
+
+    if(v) {
+      vst1_u8(u + begin / 2, cb);
+      vst1_u8(v + begin / 2, cr);
+    }
+    else {
+      vst2_u8(u + begin, (uint8x8x2_t { cb, cr }));
+    }
+  }
+
+  return begin;
+}
+#endif
+
+/**
+ * Kernels ordered from widest to narrowest, the narrower ones convert what remains of the rows.
+ * The list always ends with rows_scalar
+ */
+static rows_f kernels[3] {
+  rows_scalar
+};
+static std::string_view kernels_name = "scalar"sv;
+
+void init() {
+  auto kernel = std::begin(kernels);
+  auto push   = [&kernel](rows_f rows, const std::string_view &rows_name) {
+    if(kernel == std::begin(kernels)) {
+      kernels_name = rows_name;
+    }
+
+    *kernel++ = rows;
+  };
+
+#if defined(SUNSHINE_YUV_X86)
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2")) {
+    push(rows_avx2, "AVX2"sv);
+  }
+#elif defined(SUNSHINE_YUV_NEON)
+  push(rows_neon, "NEON"sv);
+#endif
+
+  *kernel = rows_scalar;
+
+  BOOST_LOG(info) << "Colour conversion: using "sv << kernels_name;
+}
+
+std::string_view name() {
+  return kernels_name;
+}
+
+void convert(const matrix_t &matrix, const std::uint8_t *bgrx, int pitch, int width, int begin, int end, const planes_t &planes) {
+  for(auto row = begin; row < end; row += 2) {
+    auto row0 = bgrx + row * pitch;
+    auto y0   = planes.y + row * planes.y_pitch;
+
+    auto u = planes.u + row / 2 * planes.uv_pitch;
+    auto v = planes.v ? planes.v + row / 2 * planes.uv_pitch : nullptr;
+
+    int x = 0;
+    for(auto kernel = std::begin(kernels); x < width; ++kernel) {
+      x = (*kernel)(matrix, row0, row0 + pitch, y0, y0 + planes.y_pitch, u, v, x, width);
+    }
+  }
+}
+
+converter_t::~converter_t() {
+  {
+    std::lock_guard lg { _lock };
+    _running = false;
+  }
+  _work_cv.notify_all();
+
+  for(auto &thread : _threads) {
+    thread.join();
+  }
+}
+
+void converter_t::start(int nr_threads) {
+  _running = true;
+
+  for(auto x = 0; x < nr_threads; ++x) {
+    _threads.emplace_back([this]() {
+      std::uint64_t image = 0;
+
+      while(true) {
+        {
+          std::unique_lock ul { _lock };
+          _work_cv.wait(ul, [&]() { return !_running || _image != image; });
+
+          if(!_running) {
+            return;
+          }
+
+          image = _image;
+        }
+
+        run_stripes();
+
+        std::lock_guard lg { _lock };
+        if(!--_busy) {
+          _done_cv.notify_one();
+        }
+      }
+    });
+  }
+}
+
+void converter_t::run_stripes() {
+  for(auto stripe = _next_stripe++; stripe < _nr_stripes; stripe = _next_stripe++) {
+    auto begin = stripe * _stripe_rows;
+
+    yuv::convert(*_matrix, _bgrx, _pitch, _width, begin, std::min(begin + _stripe_rows, _height), _planes);
+  }
+}
+
+void converter_t::convert(const matrix_t &matrix, const std::uint8_t *bgrx, int pitch, int width, int height, const planes_t &planes) {
+  auto nr_stripes = std::clamp(height / min_stripe_rows, 1, (int)_threads.size() + 1);
+  if(nr_stripes == 1) {
+    yuv::convert(matrix, bgrx, pitch, width, 0, height, planes);
+
+    return;
+  }
+
+  // Each stripe starts on an even row
+  auto stripe_rows = ((height + nr_stripes - 1) / nr_stripes + 1) & ~1;
+
+  {
+    std::lock_guard lg { _lock };
+
+    _matrix      = &matrix;
+    _bgrx        = bgrx;
+    _pitch       = pitch;
+    _width       = width;
+    _height      = height;
+    _planes      = planes;
+    _stripe_rows = stripe_rows;
+    _nr_stripes  = (height + stripe_rows - 1) / stripe_rows;
+    _next_stripe = 0;
+    _busy        = _threads.size();
+
+    ++_image;
+  }
+  _work_cv.notify_all();
+
+  run_stripes();
+
+  std::unique_lock ul { _lock };
+  _done_cv.wait(ul, [this]() { return !_busy; });
+}
+} // namespace yuv
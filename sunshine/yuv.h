@@ -0,0 +1,129 @@
+#ifndef SUNSHINE_YUV_H
+#define SUNSHINE_YUV_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/**
+ * Vectorized conversion of BGRX images to YUV420P and NV12, without scaling.
+ *
+ * Each 2x2 block of pixels shares the average of its chroma.
+ * The matrices are in fixed point, so every implementation generates the exact same planes.
+ */
+namespace yuv {
+constexpr auto luma_shift = 14;
+
+// The chroma is computed from the sum of 4 pixels
+constexpr auto chroma_shift = luma_shift + 2;
+
+/**
+ * The weights of the channels of a pixel in memory: B, G, R, X
+ * scaled by 1 << luma_shift
+ */
+struct matrix_t {
+  std::int16_t y[4];
+  std::int16_t u[4];
+  std::int16_t v[4];
+
+  // The offset of each plane, including the rounding, in the scale of its shift
+  std::int32_t y_add;
+  std::int32_t uv_add;
+};
+
+/**
+ * Kr, Kb --> the weights of red and blue in the luma
+ * full_range --> [0, 255] instead of [16, 235] for Y and [16, 240] for U and V
+ */
+matrix_t make_matrix(float Kr, float Kb, bool full_range);
+
+/**
+ * The destination of the conversion
+ * For NV12, u points to the interleaved chroma plane and v is nullptr
+ */
+struct planes_t {
+  std::uint8_t *y;
+  std::uint8_t *u;
+  std::uint8_t *v;
+
+  int y_pitch;
+  int uv_pitch;
+};
+
+/**
+ * Select the fastest implementation supported by the cpu.
+ * Must be called before convert()
+ */
+void init();
+
+/**
+ * returns the name of the selected implementation
+ */
+std::string_view name();
+
+/**
+ * Convert the rows [begin, end) of a BGRX image
+ * width, begin and end must be even
+ */
+void convert(const matrix_t &matrix, const std::uint8_t *bgrx, int pitch, int width, int begin, int end, const planes_t &planes);
+
+/**
+ * Splits each image into stripes of rows, converted in parallel by a few threads and the calling thread
+ */
+class converter_t {
+public:
+  static constexpr auto min_stripe_rows = 64;
+
+  converter_t() = default;
+  converter_t(converter_t &&) = delete;
+
+  ~converter_t();
+
+  /**
+   * nr_threads --> the number of threads besides the one calling convert()
+   */
+  void start(int nr_threads);
+
+  /**
+   * Convert a BGRX image of width x height, both must be even
+   */
+  void convert(const matrix_t &matrix, const std::uint8_t *bgrx, int pitch, int width, int height, const planes_t &planes);
+
+private:
+  /**
+   * Convert stripes until none are left
+   */
+  void run_stripes();
+
+  std::vector<std::thread> _threads;
+
+  std::mutex _lock;
+  std::condition_variable _work_cv;
+  std::condition_variable _done_cv;
+
+  bool _running { false };
+
+  // Incremented for each image
+  std::uint64_t _image { 0 };
+
+  // The threads that haven't finished the current image
+  int _busy { 0 };
+
+  std::atomic<int> _next_stripe { 0 };
+  int _nr_stripes;
+  int _stripe_rows;
+
+  const matrix_t *_matrix;
+  const std::uint8_t *_bgrx;
+  int _pitch;
+  int _width;
+  int _height;
+  planes_t _planes;
+};
+} // namespace yuv
+
+#endif //SUNSHINE_YUV_H